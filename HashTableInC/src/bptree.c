@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bptree.h"
+
+// Keys per node. 32 pointers fill a few cache lines, which keeps the tree
+// shallow (3 levels for ~30k keys) and scans mostly sequential.
+#define BPT_ORDER 32
+
+typedef struct bpt_node {
+    int is_leaf;
+    int num_keys;
+    struct bpt_node* prev;     // leaf chain
+    struct bpt_node* next;
+    char* keys[BPT_ORDER + 1];  // internal nodes only, one spare slot before a split
+    union {
+        struct bpt_node* children[BPT_ORDER + 2];
+        ht_item* items[BPT_ORDER + 1];
+    } u;
+} bpt_node;
+
+static int is_digit(const char c) {
+    return isdigit((unsigned char)c);
+}
+
+static int digit_run(const char* s) {
+    int n = 0;
+    while (is_digit(s[n]))
+        n++;
+    return n;
+}
+
+int bpt_key_cmp(const char* a, const char* b) {
+    while (*a && *b) {
+        if (is_digit(*a) && is_digit(*b)) {
+            const int len_a = digit_run(a);
+            const int len_b = digit_run(b);
+            if (len_a != len_b)
+                return len_a < len_b ? -1 : 1;
+            const int c = memcmp(a, b, (size_t)len_a);
+            if (c != 0)
+                return c < 0 ? -1 : 1;
+            a += len_a;
+            b += len_a;
+            continue;
+        }
+        if (*a != *b)
+            return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+        a++;
+        b++;
+    }
+    if (*a == *b)
+        return 0;
+    return *a == '\0' ? -1 : 1;
+}
+
+static bpt_node* bpt_new_node(const int is_leaf) {
+    bpt_node* node = calloc(1, sizeof(bpt_node));
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+static void bpt_del_node(bpt_node* node) {
+    if (!node->is_leaf) {
+        for (int i = 0; i < node->num_keys; ++i)
+            free(node->keys[i]);
+        for (int i = 0; i <= node->num_keys; ++i)
+            bpt_del_node(node->u.children[i]);
+    }
+    free(node);
+}
+
+bpt_tree* bpt_new() {
+    bpt_tree* tree = malloc(sizeof(bpt_tree));
+    tree->root = bpt_new_node(1);
+    tree->first_leaf = tree->root;
+    tree->count = 0;
+    return tree;
+}
+
+void bpt_del_tree(bpt_tree* tree) {
+    bpt_del_node(tree->root);
+    free(tree);
+}
+
+// Index of the child whose subtree may contain key. Keys equal to a separator go right.
+static int bpt_child_index(const bpt_node* node, const char* key) {
+    int lo = 0, hi = node->num_keys;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (bpt_key_cmp(key, node->keys[mid]) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// First slot in a leaf whose key is >= key.
+static int bpt_leaf_lower_bound(const bpt_node* leaf, const char* key) {
+    int lo = 0, hi = leaf->num_keys;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (bpt_key_cmp(leaf->u.items[mid]->key, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Returns 1 if node was split; the new right sibling and the separator that
+ * goes up to the parent are written to *right and *sep.
+ */
+static int bpt_insert_rec(bpt_tree* tree, bpt_node* node, ht_item* item, bpt_node** right, char** sep) {
+    if (node->is_leaf) {
+        const int pos = bpt_leaf_lower_bound(node, item->key);
+        if (pos < node->num_keys && bpt_key_cmp(node->u.items[pos]->key, item->key) == 0) {
+            node->u.items[pos] = item;
+            return 0;
+        }
+        memmove(&node->u.items[pos + 1], &node->u.items[pos], (size_t)(node->num_keys - pos) * sizeof(ht_item*));
+        node->u.items[pos] = item;
+        node->num_keys++;
+        tree->count++;
+        if (node->num_keys <= BPT_ORDER)
+            return 0;
+
+        bpt_node* sibling = bpt_new_node(1);
+        const int half = node->num_keys / 2;
+        sibling->num_keys = node->num_keys - half;
+        memcpy(sibling->u.items, &node->u.items[half], (size_t)sibling->num_keys * sizeof(ht_item*));
+        node->num_keys = half;
+
+        sibling->prev = node;
+        sibling->next = node->next;
+        if (node->next != NULL)
+            node->next->prev = sibling;
+        node->next = sibling;
+
+        *right = sibling;
+        *sep = strdup(sibling->u.items[0]->key);
+        return 1;
+    }
+
+    const int idx = bpt_child_index(node, item->key);
+    bpt_node* child_right;
+    char* child_sep;
+    if (!bpt_insert_rec(tree, node->u.children[idx], item, &child_right, &child_sep))
+        return 0;
+
+    memmove(&node->keys[idx + 1], &node->keys[idx], (size_t)(node->num_keys - idx) * sizeof(char*));
+    memmove(&node->u.children[idx + 2], &node->u.children[idx + 1], (size_t)(node->num_keys - idx) * sizeof(bpt_node*));
+    node->keys[idx] = child_sep;
+    node->u.children[idx + 1] = child_right;
+    node->num_keys++;
+    if (node->num_keys <= BPT_ORDER)
+        return 0;
+
+    // The middle key moves up; its left and right halves stay in node and sibling.
+    bpt_node* sibling = bpt_new_node(0);
+    const int mid = node->num_keys / 2;
+    sibling->num_keys = node->num_keys - mid - 1;
+    memcpy(sibling->keys, &node->keys[mid + 1], (size_t)sibling->num_keys * sizeof(char*));
+    memcpy(sibling->u.children, &node->u.children[mid + 1], (size_t)(sibling->num_keys + 1) * sizeof(bpt_node*));
+    *sep = node->keys[mid];
+    node->num_keys = mid;
+
+    *right = sibling;
+    return 1;
+}
+
+void bpt_insert(bpt_tree* tree, ht_item* item) {
+    bpt_node* right;
+    char* sep;
+    if (bpt_insert_rec(tree, tree->root, item, &right, &sep)) {
+        bpt_node* root = bpt_new_node(0);
+        root->num_keys = 1;
+        root->keys[0] = sep;
+        root->u.children[0] = tree->root;
+        root->u.children[1] = right;
+        tree->root = root;
+    }
+}
+
+static void bpt_unlink_leaf(bpt_tree* tree, bpt_node* leaf) {
+    if (leaf->prev != NULL)
+        leaf->prev->next = leaf->next;
+    else
+        tree->first_leaf = leaf->next;
+    if (leaf->next != NULL)
+        leaf->next->prev = leaf->prev;
+}
+
+/**
+ * Deletion does not rebalance: a node is only removed once it becomes empty.
+ * Lookups stay correct because removing child i together with the separator
+ * next to it just widens the key range of a neighbouring child, and the tree
+ * can never get deeper than insertions made it.
+ *
+ * Returns 1 if node is now empty and should be removed by its parent.
+ */
+static int bpt_delete_rec(bpt_tree* tree, bpt_node* node, const char* key) {
+    if (node->is_leaf) {
+        const int pos = bpt_leaf_lower_bound(node, key);
+        if (pos == node->num_keys || bpt_key_cmp(node->u.items[pos]->key, key) != 0)
+            return 0;
+        memmove(&node->u.items[pos], &node->u.items[pos + 1], (size_t)(node->num_keys - pos - 1) * sizeof(ht_item*));
+        node->num_keys--;
+        tree->count--;
+        return node->num_keys == 0;
+    }
+
+    const int idx = bpt_child_index(node, key);
+    bpt_node* child = node->u.children[idx];
+    if (!bpt_delete_rec(tree, child, key))
+        return 0;
+
+    // An empty node has no keys left and its children are already gone.
+    if (child->is_leaf)
+        bpt_unlink_leaf(tree, child);
+    free(child);
+
+    if (node->num_keys == 0)
+        return 1;
+
+    const int key_idx = idx > 0 ? idx - 1 : 0;
+    free(node->keys[key_idx]);
+    memmove(&node->keys[key_idx], &node->keys[key_idx + 1], (size_t)(node->num_keys - key_idx - 1) * sizeof(char*));
+    memmove(&node->u.children[idx], &node->u.children[idx + 1], (size_t)(node->num_keys - idx) * sizeof(bpt_node*));
+    node->num_keys--;
+    return 0;
+}
+
+void bpt_delete(bpt_tree* tree, const char* key) {
+    bpt_node* root = tree->root;
+    if (bpt_delete_rec(tree, root, key) && !root->is_leaf) {
+        free(root);
+        tree->root = bpt_new_node(1);
+        tree->first_leaf = tree->root;
+        return;
+    }
+    // Collapse internal roots that are left with a single child.
+    while (!tree->root->is_leaf && tree->root->num_keys == 0) {
+        bpt_node* old_root = tree->root;
+        tree->root = old_root->u.children[0];
+        free(old_root);
+    }
+}
+
+static const bpt_node* bpt_find_leaf(const bpt_tree* tree, const char* key, int* pos) {
+    const bpt_node* node = tree->root;
+    if (key == NULL) {
+        *pos = 0;
+        return tree->first_leaf;
+    }
+    while (!node->is_leaf)
+        node = node->u.children[bpt_child_index(node, key)];
+    *pos = bpt_leaf_lower_bound(node, key);
+    return node;
+}
+
+int bpt_range_scan(const bpt_tree* tree, const char* lo, const char* hi, ht_scan_fn fn, void* arg) {
+    int pos;
+    int visited = 0;
+    for (const bpt_node* leaf = bpt_find_leaf(tree, lo, &pos); leaf != NULL; leaf = leaf->next, pos = 0) {
+        for (; pos < leaf->num_keys; ++pos) {
+            const ht_item* item = leaf->u.items[pos];
+            if (hi != NULL && bpt_key_cmp(item->key, hi) > 0)
+                return visited;
+            visited++;
+            if (fn(item->key, item->value, arg))
+                return visited;
+        }
+    }
+    return visited;
+}
+
+/**
+ * Keys sharing a prefix are contiguous in natural order unless the prefix
+ * ends inside a digit run: "key_12" matches key_12, key_120..key_129,
+ * key_1200.. which sit in one run per digit count. Those runs are visited
+ * one after another, seeking straight to the next digit count present.
+ */
+int bpt_prefix_scan(const bpt_tree* tree, const char* prefix, ht_scan_fn fn, void* arg) {
+    const int prefix_len = (int)strlen(prefix);
+    int stem_len = prefix_len;
+    while (stem_len > 0 && is_digit(prefix[stem_len - 1]))
+        stem_len--;
+    const int digits = prefix_len - stem_len;
+
+    char* probe = NULL;
+    int visited = 0;
+    int run_len = digits;
+    while (1) {
+        // Smallest key with this many digits after the stem: the prefix padded with zeros.
+        const char* start = prefix;
+        if (digits > 0) {
+            probe = realloc(probe, (size_t)(stem_len + run_len) + 1);
+            memcpy(probe, prefix, (size_t)prefix_len);
+            memset(probe + prefix_len, '0', (size_t)(run_len - digits));
+            probe[stem_len + run_len] = '\0';
+            start = probe;
+        }
+
+        int pos;
+        const bpt_node* leaf = bpt_find_leaf(tree, start, &pos);
+        const ht_item* stop = NULL;
+        for (; leaf != NULL && stop == NULL; leaf = leaf->next, pos = 0) {
+            for (; pos < leaf->num_keys; ++pos) {
+                const ht_item* item = leaf->u.items[pos];
+                if (strncmp(item->key, prefix, (size_t)prefix_len) != 0
+                    || (digits > 0 && digit_run(item->key + stem_len) != run_len)) {
+                    stop = item;
+                    break;
+                }
+                visited++;
+                if (fn(item->key, item->value, arg)) {
+                    free(probe);
+                    return visited;
+                }
+            }
+        }
+
+        if (digits == 0 || stop == NULL || strncmp(stop->key, prefix, (size_t)stem_len) != 0)
+            break;
+        const int next_len = digit_run(stop->key + stem_len);
+        if (next_len < run_len)
+            break;
+        run_len = next_len > run_len ? next_len : run_len + 1;
+    }
+
+    free(probe);
+    return visited;
+}
@@ -0,0 +1,36 @@
+#ifndef BPTREE_H
+#define BPTREE_H
+
+#include "hash_table.h"
+
+/**
+ * B+-tree over hash table items, used as the ordered index of ht_new_ordered().
+ *
+ * Leaves hold the ht_item pointers owned by the hash table and are chained
+ * for scans; internal nodes hold their own copies of the separator keys.
+ * Keys are ordered by bpt_key_cmp().
+ */
+struct bpt_tree {
+    struct bpt_node* root;
+    struct bpt_node* first_leaf;
+    int count;
+};
+
+/**
+ * Natural order: digit runs compare by length and then digit by digit
+ * (i.e. by value when there are no leading zeros), all other bytes compare
+ * as unsigned chars. So "key_9" < "key_10" < "key_100".
+ */
+int bpt_key_cmp(const char* a, const char* b);
+
+bpt_tree* bpt_new();
+void bpt_del_tree(bpt_tree* tree);
+
+void bpt_insert(bpt_tree* tree, ht_item* item);
+void bpt_delete(bpt_tree* tree, const char* key);
+
+/* lo/hi are inclusive, NULL means unbounded. */
+int bpt_range_scan(const bpt_tree* tree, const char* lo, const char* hi, ht_scan_fn fn, void* arg);
+int bpt_prefix_scan(const bpt_tree* tree, const char* prefix, ht_scan_fn fn, void* arg);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include "hash_table.h"
+#include "bptree.h"
 #include "prime.h"
 
 static const int HT_INITIAL_BASE_SIZE = 50;
@@ -26,6 +27,7 @@ static ht_hash_table* ht_new_sized(const int base_size) {
 
     ht->count = 0;
     ht->items = calloc((size_t)ht->size, sizeof(ht_item*));
+    ht->index = NULL;
     return ht;
 }
 
@@ -33,6 +35,26 @@ ht_hash_table* ht_new() {
     return ht_new_sized(HT_INITIAL_BASE_SIZE);
 }
 
+ht_hash_table* ht_new_ordered() {
+    ht_hash_table* ht = ht_new_sized(HT_INITIAL_BASE_SIZE);
+    ht->index = bpt_new();
+    return ht;
+}
+
+static int ht_get_hash(const char* s, const int num_buckets, const int attempt);
+
+// Places an existing item without copying it, so the ordered index can keep pointing at it.
+static void ht_insert_item(ht_hash_table* ht, ht_item* item) {
+    int index = ht_get_hash(item->key, ht->size, 0);
+    int i = 1;
+    while (ht->items[index] != NULL) {
+        index = ht_get_hash(item->key, ht->size, i);
+        i++;
+    }
+    ht->items[index] = item;
+    ht->count++;
+}
+
 static void ht_resize(ht_hash_table* ht, const int base_size) {
     if (base_size < HT_INITIAL_BASE_SIZE)
         return;
@@ -41,7 +63,7 @@ static void ht_resize(ht_hash_table* ht, const int base_size) {
     for (int i = 0; i < ht->size; ++i) {
         ht_item* item = ht->items[i];
         if (item != NULL && item != &HT_DELETED_ITEM) {
-            ht_insert(new_ht, item->key, item->value);
+            ht_insert_item(new_ht, item);
         }
     }
 
@@ -52,11 +74,10 @@ static void ht_resize(ht_hash_table* ht, const int base_size) {
     ht->size = new_ht->size;
     new_ht->size = tmp_size;
 
-    ht_item** tmp_items = ht->items;
+    // The items moved to the new array, only the old array is released.
+    free(ht->items);
     ht->items = new_ht->items;
-    new_ht->items = tmp_items;
-
-    ht_del_hash_table(new_ht);
+    free(new_ht);
 }
 
 static void ht_resize_up(ht_hash_table* ht) {
@@ -82,11 +103,13 @@ static void ht_del_item(ht_item* i) {
 void ht_del_hash_table(ht_hash_table* ht) {
     for (int i = 0; i < ht->size; ++i) {
         ht_item* item = ht->items[i];
-        if (item != NULL) {
+        if (item != NULL && item != &HT_DELETED_ITEM) {
             printf("index: %d, key: %s, value: %s\n", i, item->key, item->value);
             ht_del_item(item);
         }
     }
+    if (ht->index != NULL)
+        bpt_del_tree(ht->index);
     free(ht->items);
     free(ht);
 }
@@ -119,6 +142,8 @@ void ht_delete(ht_hash_table* ht, const char* key) {
     while(item != NULL) {
         if (item != &HT_DELETED_ITEM) {
             if (strcmp(item->key, key) == 0) {
+                if (ht->index != NULL)
+                    bpt_delete(ht->index, key);
                 ht_del_item(item);
                 ht->items[index] = &HT_DELETED_ITEM;
                 ht->count--;
@@ -137,15 +162,15 @@ void ht_insert(ht_hash_table* ht, const char* key, const char* value) {
         ht_resize_up(ht);
     }
 
-    ht_item* item = ht_new_item(key, value);
     int index = ht_get_hash(key, ht->size, 0);
     ht_item* cur_item = ht->items[index];
     int i = 1;
     while (cur_item != NULL) {
         if (cur_item != &HT_DELETED_ITEM) {
             if (strcmp(cur_item->key, key) == 0) {
-                ht_del_item(cur_item);
-                ht->items[index] = item;
+                // Update in place so the item pointer held by the index stays valid.
+                free(cur_item->value);
+                cur_item->value = strdup(value);
                 return;
             }
         }
@@ -153,8 +178,11 @@ void ht_insert(ht_hash_table* ht, const char* key, const char* value) {
         cur_item = ht->items[index];
         i++;
     }
+    ht_item* item = ht_new_item(key, value);
     ht->items[index] = item;
     ht->count++;
+    if (ht->index != NULL)
+        bpt_insert(ht->index, item);
 }
 
 char* ht_search(ht_hash_table* ht, const char* key) {
@@ -173,4 +201,16 @@ char* ht_search(ht_hash_table* ht, const char* key) {
     }
 
     return NULL;
+}
+
+int ht_range_scan(ht_hash_table* ht, const char* lo, const char* hi, ht_scan_fn fn, void* arg) {
+    if (ht->index == NULL)
+        return -1;
+    return bpt_range_scan(ht->index, lo, hi, fn, arg);
+}
+
+int ht_prefix_scan(ht_hash_table* ht, const char* prefix, ht_scan_fn fn, void* arg) {
+    if (ht->index == NULL)
+        return -1;
+    return bpt_prefix_scan(ht->index, prefix, fn, arg);
 }
\ No newline at end of file
@@ -1,18 +1,39 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
 typedef struct {
     char* key;
     char* value;
 } ht_item;
 
+typedef struct bpt_tree bpt_tree;
+
 typedef struct {
     int base_size;
     int size;
     int count;
     ht_item** items;
+    bpt_tree* index;    // optional ordered index, NULL unless created by ht_new_ordered()
 } ht_hash_table;
 
+// Return non-zero to stop a scan early.
+typedef int (*ht_scan_fn)(const char* key, const char* value, void* arg);
+
 ht_hash_table* ht_new();
+ht_hash_table* ht_new_ordered();
 void ht_del_hash_table(ht_hash_table* ht);
 
 void  ht_insert(ht_hash_table* ht, const char* key, const char* value);
 char* ht_search(ht_hash_table* ht, const char* key);
-void  ht_delete(ht_hash_table* ht, const char* key);
\ No newline at end of file
+void  ht_delete(ht_hash_table* ht, const char* key);
+
+/**
+ * Ordered scans, only available on tables created by ht_new_ordered().
+ * Keys are visited in natural order (digit runs compare numerically), so
+ * ht_range_scan(ht, "key_100", "key_500", ...) yields key_100 .. key_500.
+ * Returns the number of items visited, or -1 if the table has no index.
+ */
+int ht_range_scan(ht_hash_table* ht, const char* lo, const char* hi, ht_scan_fn fn, void* arg);
+int ht_prefix_scan(ht_hash_table* ht, const char* prefix, ht_scan_fn fn, void* arg);
+
+#endif
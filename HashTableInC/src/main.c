@@ -4,6 +4,23 @@
 
 #include "hash_table.h"
 
+typedef struct {
+    int count;
+    long long last;
+    int out_of_order;
+} scan_state;
+
+static int collect_key(const char* key, const char* value, void* arg) {
+    (void)value;
+    scan_state* state = arg;
+    long long number = atoll(key + strlen("key_"));
+    if (state->count > 0 && number <= state->last) {
+        state->out_of_order = 1;
+    }
+    state->last = number;
+    state->count++;
+    return 0;
+}
 
 int main() {
 
@@ -13,7 +30,7 @@ int main() {
         return 1;
     }
 
-    ht_hash_table* ht = ht_new();
+    ht_hash_table* ht = ht_new_ordered();
 
     char line[256];
     char key[128];
@@ -116,6 +133,37 @@ int main() {
         }
     }
 
+    // Test ordered range and prefix scans against a brute-force pass over the remaining keys
+    const long long range_lo = 500000000, range_hi = 1500000000;
+    const char* prefix = "key_1";
+    int expected_range = 0, expected_prefix = 0;
+    for (int i = 1; i < count; i += 2) {
+        long long number = atoll(keys[i] + strlen("key_"));
+        if (number >= range_lo && number <= range_hi) {
+            expected_range++;
+        }
+        if (strncmp(keys[i], prefix, strlen(prefix)) == 0) {
+            expected_prefix++;
+        }
+    }
+
+    char lo_key[64], hi_key[64];
+    sprintf(lo_key, "key_%lld", range_lo);
+    sprintf(hi_key, "key_%lld", range_hi);
+    scan_state range_state = {0, 0, 0};
+    ht_range_scan(ht, lo_key, hi_key, collect_key, &range_state);
+    if (range_state.count != expected_range || range_state.out_of_order) {
+        printf("Error: Range scan [%s, %s] visited %d keys, expected %d in order\n", lo_key, hi_key, range_state.count, expected_range);
+    }
+
+    scan_state prefix_state = {0, 0, 0};
+    ht_prefix_scan(ht, prefix, collect_key, &prefix_state);
+    if (prefix_state.count != expected_prefix) {
+        printf("Error: Prefix scan '%s' visited %d keys, expected %d\n", prefix, prefix_state.count, expected_prefix);
+    }
+
+    printf("range scan: %d keys, prefix scan: %d keys\n", range_state.count, prefix_state.count);
+
     // Clean up allocated memory
     for (int i = 0; i < count; ++i) {
         free(keys[i]);
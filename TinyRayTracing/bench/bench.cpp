@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "renderer.h"
+#include "scene_io.h"
+#include "thread_pool.h"
+
+#ifndef TRT_BENCH_REFERENCE_DIR
+#define TRT_BENCH_REFERENCE_DIR "bench/reference"
+#endif
+
+/**
+ * Render benchmark: a fixed set of generated scenes at a fixed resolution.
+ * Reports the acceleration structure build time, the frame time (best of
+ * --runs) and primary plus secondary rays per second, then compares each
+ * image against bench/reference/<name>.ppm so a speedup that changes the
+ * picture does not go unnoticed. Exits with 1 when any image is off.
+ */
+
+namespace {
+
+const int bench_width  = 256;
+const int bench_height = 192;
+
+enum material_mix { mix_all, mix_diffuse, mix_glass, mix_mirror };
+
+struct bench_scene {
+    const char  *name;
+    size_t       spheres;       // 0 is the built-in default scene
+    int          lights;
+    material_mix mix;
+};
+
+const bench_scene bench_scenes[] = {
+    { "default",      0,       3,  mix_all },
+    { "spheres-1k",   1000,    3,  mix_all },
+    { "spheres-100k", 100000,  3,  mix_all },
+    { "spheres-1m",   1000000, 3,  mix_all },
+    { "lights-1",     1000,    1,  mix_all },
+    { "lights-8",     1000,    8,  mix_all },
+    { "lights-64",    1000,    64, mix_all },
+    { "diffuse",      1000,    3,  mix_diffuse },
+    { "glass",        1000,    3,  mix_glass },
+    { "mirror",       1000,    3,  mix_mirror },
+};
+
+// Small LCG so the scenes come out the same with every standard library.
+struct bench_random {
+    uint64_t state;
+    explicit bench_random(uint64_t seed) : state(seed) {}
+    float next() {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return float(state >> 40) / float(1 << 24);
+    }
+    float range(float lo, float hi) { return lo + (hi - lo) * next(); }
+};
+
+void build_scene(const bench_scene &b, scene &sc) {
+    if (b.spheres == 0) {
+        default_scene(sc);
+        return;
+    }
+    const uint32_t  ivory = sc.add_material(material(1.0, vec3(0.6, 0.3,  0.1), 0.0, vec3(0.4, 0.4, 0.3), 50.f));
+    const uint32_t  glass = sc.add_material(material(1.5, vec3(0.0, 0.5,  0.1), 0.8, vec3(0.6, 0.7, 0.8), 50.f));
+    const uint32_t rubber = sc.add_material(material(1.0, vec3(0.9, 0.1,  0.0), 0.0, vec3(0.3, 0.1, 0.1), 10.f));
+    const uint32_t mirror = sc.add_material(material(1.0, vec3(0.0, 10.0, 0.8), 0.0, vec3(1.0, 1.0, 1.0), 1425.f));
+
+    // Spheres fill a box in front of the camera above the floor; the radius shrinks with
+    // the count so the box stays about equally crowded.
+    const float lo_x = -10, hi_x = 10, lo_y = -3.5f, hi_y = 6, lo_z = -32, hi_z = -12;
+    const float volume = (hi_x - lo_x) * (hi_y - lo_y) * (hi_z - lo_z);
+    const float radius = std::min(2.f, 0.4f * std::cbrt(volume / b.spheres));
+    bench_random rng(b.spheres * 131 + b.lights * 7 + b.mix);
+    sc.spheres.reserve(b.spheres);
+    for (size_t i = 0; i < b.spheres; ++i) {
+        const vec3 center(rng.range(lo_x, hi_x), rng.range(lo_y, hi_y), rng.range(lo_z, hi_z));
+        const float r = radius * rng.range(0.5f, 1.f);
+        uint32_t m;
+        switch (b.mix) {
+        case mix_diffuse: m = rng.next() < 0.5f ? ivory : rubber; break;
+        case mix_glass:   m = glass; break;
+        case mix_mirror:  m = mirror; break;
+        default:          m = uint32_t(std::min(3, int(rng.next() * 4))); break;     // the four materials above
+        }
+        sc.spheres.push_back(sphere(center, r, m));
+    }
+    // Lights on a ring above the scene; the total intensity stays that of the default scene.
+    for (int i = 0; i < b.lights; ++i) {
+        const float a = 6.2831853f * (i + 0.5f) / b.lights;
+        sc.lights.push_back(light(vec3(30 * std::cos(a), 20 + 10 * (i % 3), -20 + 30 * std::sin(a)), 5.f / b.lights));
+    }
+    add_checkerboard_floor(sc);
+}
+
+bool read_ppm(const std::string &path, std::vector<unsigned char> &pixels) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0, max = 0;
+    if (!(in >> magic >> width >> height >> max) || magic != "P6" || width != bench_width || height != bench_height || max != 255)
+        return false;
+    in.get();
+    pixels.resize(size_t(width) * height * 3);
+    return bool(in.read(reinterpret_cast<char *>(pixels.data()), pixels.size()));
+}
+
+void write_ppm(const std::string &path, const std::vector<unsigned char> &pixels) {
+    std::unique_ptr<image_writer> out = open_image_writer(path, bench_width, bench_height);
+    out->write_rows(pixels.data(), bench_height);
+    out->finish();
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    render_options opts;
+    opts.width  = bench_width;
+    opts.height = bench_height;
+    std::string filter;
+    std::string reference_dir = TRT_BENCH_REFERENCE_DIR;
+    int runs = 1;
+    int tolerance = 8;          // largest channel difference that still counts as equal
+    double max_differing = 0.001;
+    bool update = false;
+    bool ok = true;
+    // std::stoi and friends throw on text that is no number, or one out of range.
+    try {
+        for (int i = 1; i < argc && ok; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+                const int threads = std::stoi(argv[++i]);
+                ok = threads >= 0 && size_t(threads) <= thread_pool::max_threads();
+                opts.threads = size_t(threads);
+            } else if (arg == "--simd" && i + 1 < argc) {
+                opts.simd = argv[++i];
+            } else if (arg == "--wavefront") {
+                opts.settings.wavefront = true;
+            } else if (arg == "--filter" && i + 1 < argc) {
+                filter = argv[++i];
+            } else if (arg == "--runs" && i + 1 < argc) {
+                runs = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--tolerance" && i + 1 < argc) {
+                tolerance = std::stoi(argv[++i]);
+            } else if (arg == "--max-differing" && i + 1 < argc) {
+                max_differing = std::stod(argv[++i]);
+            } else if (arg == "--references" && i + 1 < argc) {
+                reference_dir = argv[++i];
+            } else if (arg == "--stats") {
+                opts.stats = true;
+            } else if (arg == "--update-references") {
+                update = true;
+            } else {
+                ok = false;
+            }
+        }
+    } catch (const std::logic_error &) {
+        ok = false;
+    }
+    if (!ok) {
+        std::cerr << "usage: " << argv[0] << " [--threads N] [--simd auto|avx2|sse|scalar] [--wavefront] [--filter SUBSTRING] [--runs N]"
+                  << " [--tolerance CHANNEL_DIFF] [--max-differing FRACTION] [--references DIR] [--update-references] [--stats]" << std::endl;
+        return 1;
+    }
+
+    printf("%-14s %9s %7s %10s %10s %10s  %s\n", "scene", "spheres", "lights", "build ms", "frame ms", "Mrays/s", "reference");
+    int failures = 0;
+    for (const bench_scene &b : bench_scenes) {
+        if (!filter.empty() && std::string(b.name).find(filter) == std::string::npos)
+            continue;
+
+        scene sc;
+        build_scene(b, sc);
+        const std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+        sc.build_accel();
+        const double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+        render_result best;
+        memory_writer image(bench_width);
+        for (int run = 0; run < runs; ++run) {
+            image.pixels.clear();
+            const render_result result = render(sc, opts, image);
+            if (run == 0 || result.seconds < best.seconds)
+                best = result;
+        }
+
+        const std::string reference = reference_dir + "/" + b.name + ".ppm";
+        std::string verdict;
+        std::vector<unsigned char> expected;
+        if (update) {
+            try {
+                write_ppm(reference, image.pixels);
+                verdict = "updated";
+            } catch (const image_error &e) {
+                verdict = e.what();
+                ++failures;
+            }
+        } else if (!read_ppm(reference, expected)) {
+            verdict = "missing, run with --update-references";
+            ++failures;
+        } else {
+            size_t differing = 0;
+            int worst = 0;
+            for (size_t p = 0; p < image.pixels.size(); p += 3) {
+                int diff = 0;
+                for (int c = 0; c < 3; ++c)
+                    diff = std::max(diff, std::abs(int(image.pixels[p + c]) - int(expected[p + c])));
+                worst = std::max(worst, diff);
+                differing += diff > tolerance;
+            }
+            const double fraction = double(differing) / (bench_width * bench_height);
+            char text[96];
+            snprintf(text, sizeof(text), "%s (max diff %d, %.3f%% pixels over %d)",
+                     fraction <= max_differing ? "ok" : "MISMATCH", worst, fraction * 100, tolerance);
+            verdict = text;
+            failures += fraction > max_differing;
+        }
+
+        printf("%-14s %9zu %7zu %10.1f %10.1f %10.2f  %s\n", b.name, sc.spheres.size(), sc.lights.size(),
+               build_seconds * 1e3, best.seconds * 1e3, best.rays.rays() / best.seconds * 1e-6, verdict.c_str());
+        fflush(stdout);
+    }
+    return failures ? 1 : 0;
+}
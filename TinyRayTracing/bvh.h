@@ -0,0 +1,265 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+/**
+ * Nodes are stored depth first: the left child of an interior node is the
+ * next node in the array, offset points to the right child.
+ */
+struct bvh_node {
+    aabb     bounds;
+    uint32_t offset;    // leaf: first entry in bvh::prims, interior: index of the right child
+    uint16_t count;     // primitives in a leaf, 0 for interior nodes
+    uint16_t axis;      // split axis of an interior node, used to visit the near child first
+    bool is_leaf() const { return count > 0; }
+};
+
+/**
+ * Bounding volume hierarchy over primitive bounds, built with the binned
+ * surface area heuristic and flattened into a compact node array.
+ * It only knows primitive indices; traverse() hands every primitive of a
+ * visited leaf to a callback which does the actual intersection.
+ */
+class bvh {
+public:
+    std::vector<bvh_node> nodes;
+    std::vector<uint32_t> prims;    // primitive indices, leaves reference contiguous ranges
+
+    bool empty() const { return nodes.empty(); }
+
+    void build(const std::vector<aabb> &prim_bounds) {
+        nodes.clear();
+        prims.resize(prim_bounds.size());
+        if (prim_bounds.empty())
+            return;
+
+        centroids_.resize(prim_bounds.size());
+        for (size_t i = 0; i < prim_bounds.size(); ++i) {
+            prims[i] = uint32_t(i);
+            centroids_[i] = prim_bounds[i].centroid();
+        }
+        nodes.reserve(2 * prim_bounds.size());
+        build_node(prim_bounds, 0, uint32_t(prim_bounds.size()));
+        centroids_.clear();
+        centroids_.shrink_to_fit();
+    }
+
+    /**
+     * Calls leaf(prim, tmax) for the primitives of every leaf whose box the ray
+     * enters before tmax. The callback may lower tmax to prune farther nodes and
+     * returns true to stop the traversal (e.g. for any-hit queries).
+     * Returns the number of node boxes tested.
+     */
+    template <class LeafFn>
+    uint32_t traverse(const vec3 &orig, const vec3 &dir, float &tmax, LeafFn &&leaf) const {
+        return traverse_leaves(orig, dir, tmax, [&](uint32_t first, uint32_t count, float &t) {
+            for (uint32_t i = first; i < first + count; ++i) {
+                if (leaf(prims[i], t))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    /**
+     * Like traverse(), but hands over whole leaves as the range
+     * [first, first + count) of prims, for callers that test several
+     * primitives of a leaf at once.
+     */
+    template <class LeafFn>
+    uint32_t traverse_leaves(const vec3 &orig, const vec3 &dir, float &tmax, LeafFn &&leaf) const {
+        if (nodes.empty())
+            return 0;
+        const vec3 inv_dir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+        const bool dir_neg[3] = { dir.x < 0, dir.y < 0, dir.z < 0 };
+
+        uint32_t stack[64];
+        int stack_size = 0;
+        uint32_t current = 0;
+        uint32_t visited = 0;
+        for (;; ++visited) {
+            const bvh_node &node = nodes[current];
+            if (hit_box(node.bounds, orig, inv_dir, tmax)) {
+                if (node.is_leaf()) {
+                    if (leaf(node.offset, uint32_t(node.count), tmax))
+                        return visited + 1;
+                } else if (dir_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                    continue;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+            }
+            if (stack_size == 0)
+                return visited + 1;
+            current = stack[--stack_size];
+        }
+    }
+
+    /**
+     * Recomputes every box bottom-up for primitives that moved, keeping the
+     * tree as built. bounds_of(prims[i]) returns the current box of leaf entry
+     * i. Much cheaper than build(), but the tree fits worse the further
+     * primitives travel; see cost().
+     */
+    template <class BoundsFn>
+    void refit(BoundsFn &&bounds_of) {
+        // Children always come after their parent, so a backwards sweep sees them first.
+        for (size_t i = nodes.size(); i-- > 0;) {
+            bvh_node &node = nodes[i];
+            aabb b;
+            if (node.is_leaf()) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k)
+                    b.expand(bounds_of(prims[k]));
+            } else {
+                b.expand(nodes[i + 1].bounds);
+                b.expand(nodes[node.offset].bounds);
+            }
+            node.bounds = b;
+        }
+    }
+
+    // Summed node surface area relative to the root's: the expected number of boxes a ray tests.
+    float cost() const {
+        if (nodes.empty() || nodes[0].bounds.area() <= 0)
+            return 0;
+        double sum = 0;
+        for (const bvh_node &node : nodes)
+            sum += node.bounds.area();
+        return float(sum / nodes[0].bounds.area());
+    }
+
+    static bool hit_box(const aabb &b, const vec3 &orig, const vec3 &inv_dir, float tmax) {
+        float tmin = 0;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (b.min[a] - orig[a]) * inv_dir[a];
+            float t1 = (b.max[a] - orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0) std::swap(t0, t1);
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax < tmin)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static const int sah_bins = 16;
+    static const int max_leaf_size = 8;
+
+    std::vector<vec3> centroids_;
+
+    uint32_t build_node(const std::vector<aabb> &prim_bounds, uint32_t first, uint32_t count) {
+        const uint32_t index = uint32_t(nodes.size());
+        nodes.push_back(bvh_node());
+
+        aabb bounds, centroid_bounds;
+        for (uint32_t i = first; i < first + count; ++i) {
+            bounds.expand(prim_bounds[prims[i]]);
+            centroid_bounds.expand(centroids_[prims[i]]);
+        }
+        nodes[index].bounds = bounds;
+
+        int axis;
+        uint32_t mid;
+        if (count <= 2 || !find_split(prim_bounds, first, count, bounds, centroid_bounds, axis, mid)) {
+            nodes[index].offset = first;
+            nodes[index].count = uint16_t(count);
+            nodes[index].axis = 0;
+            return index;
+        }
+
+        nodes[index].count = 0;
+        nodes[index].axis = uint16_t(axis);
+        build_node(prim_bounds, first, mid - first);
+        nodes[index].offset = build_node(prim_bounds, mid, first + count - mid);
+        return index;
+    }
+
+    /**
+     * Picks the bin boundary with the lowest SAH cost over all axes and
+     * partitions prims around it. Returns false when a leaf is cheaper.
+     */
+    bool find_split(const std::vector<aabb> &prim_bounds, uint32_t first, uint32_t count,
+                    const aabb &bounds, const aabb &centroid_bounds, int &axis, uint32_t &mid) {
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = -1, best_bin = 0;
+
+        for (int a = 0; a < 3; ++a) {
+            const float lo = centroid_bounds.min[a];
+            const float extent = centroid_bounds.max[a] - lo;
+            if (extent <= 0)
+                continue;
+
+            aabb bin_bounds[sah_bins];
+            uint32_t bin_count[sah_bins] = {};
+            for (uint32_t i = first; i < first + count; ++i) {
+                const int b = bin_of(centroids_[prims[i]][a], lo, extent);
+                bin_count[b]++;
+                bin_bounds[b].expand(prim_bounds[prims[i]]);
+            }
+
+            // Sweep from the right to get the cost of every split in one pass each way.
+            float right_area[sah_bins];
+            uint32_t right_count[sah_bins];
+            aabb acc;
+            uint32_t n = 0;
+            for (int b = sah_bins - 1; b > 0; --b) {
+                acc.expand(bin_bounds[b]);
+                n += bin_count[b];
+                right_area[b] = acc.area();
+                right_count[b] = n;
+            }
+            acc = aabb();
+            n = 0;
+            for (int b = 0; b < sah_bins - 1; ++b) {
+                acc.expand(bin_bounds[b]);
+                n += bin_count[b];
+                const float cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+                if (n > 0 && right_count[b + 1] > 0 && cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin = b;
+                }
+            }
+        }
+
+        // Traversal is about as expensive as one primitive test.
+        const float leaf_cost = float(count);
+        const float split_cost = 1.f + best_cost / bounds.area();
+        if (best_axis < 0) {
+            if (count <= max_leaf_size)
+                return false;
+            // All centroids coincide but the leaf would be too big: split in the middle.
+            axis = 0;
+            mid = first + count / 2;
+            return true;
+        }
+        if (split_cost >= leaf_cost && count <= max_leaf_size)
+            return false;
+
+        const float lo = centroid_bounds.min[best_axis];
+        const float extent = centroid_bounds.max[best_axis] - lo;
+        uint32_t *split = std::partition(prims.data() + first, prims.data() + first + count, [&](uint32_t p) {
+            return bin_of(centroids_[p][best_axis], lo, extent) <= best_bin;
+        });
+        axis = best_axis;
+        mid = uint32_t(split - prims.data());
+        return true;
+    }
+
+    static int bin_of(float c, float lo, float extent) {
+        int b = int(sah_bins * (c - lo) / extent);
+        return std::min(std::max(b, 0), sah_bins - 1);
+    }
+};
+
+#endif
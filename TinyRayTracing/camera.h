@@ -0,0 +1,40 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <cmath>
+
+#include "geometry.h"
+
+/**
+ * Pinhole camera looking from position towards target. The defaults give the
+ * original fixed view: from the origin down -z with a vertical field of view
+ * of 1 radian (the old `int fov = M_PI / 2`, which truncated to 1).
+ */
+struct camera {
+    vec3  position = vec3(0, 0, 0);
+    vec3  target   = vec3(0, 0, -1);
+    vec3  up       = vec3(0, 1, 0);
+    float fov      = 1.f;       // vertical, in radians
+
+    // False when the view direction is zero or parallel to up, which leaves no usable basis.
+    bool valid() const {
+        const vec3 w = position - target;
+        return w.norm() > 0 && cross(up, w).norm() > 1e-6f * w.norm() * up.norm() && fov > 0 && fov < float(M_PI);
+    }
+
+    /**
+     * Primary ray direction through image position (sx, sy), measured in
+     * pixels from the top left corner; pixel (i, j) has its center at
+     * (i + 0.5, j + 0.5).
+     */
+    vec3 ray_dir(float sx, float sy, int width, int height) const {
+        const vec3 w = (position - target).normalized();
+        const vec3 u = cross(up, w).normalized();
+        const vec3 v = cross(w, u);
+        float x =  (2*double(sx)/(float)width  - 1)*tan(fov/2.)*width/(float)height;
+        float y = -(2*double(sy)/(float)height - 1)*tan(fov/2.);
+        return (u*x + v*y - w).normalized();
+    }
+};
+
+#endif
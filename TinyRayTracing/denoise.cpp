@@ -0,0 +1,157 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+// Also compiles a function for AVX2, picked when the program is loaded if the CPU has it.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define DENOISE_AVX2_CLONE __attribute__((target_clones("avx2", "default")))
+#else
+#define DENOISE_AVX2_CLONE
+#endif
+
+// 2^-e for e in [0, 64]. Only a truncating conversion and bit moves, so SSE2 vectorizes it.
+inline float exp2_negative(float e) {
+    const int32_t k = -int32_t(e);                  // ceiling of -e, so f is in (-1, 0]
+    const float f = -(e + float(k));
+    const float p = 1.f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+    const int32_t bits = (k + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof scale);
+    return p * scale;
+}
+
+struct filter_pass {
+    const denoise_buffers *guides;
+    const float *const *in;        // r, g, b planes
+    float *const *out;
+    int step;
+    float color_k, normal_k, depth_k, albedo_k;     // log2(e) / sigma^2
+};
+
+struct row_scratch {
+    std::vector<float> r, g, b, w;  // weighted sums
+    std::vector<float> e;           // exponent of the current tap's edge-stopping weight
+};
+
+// Where the color and guide planes of a row start.
+struct row_planes {
+    const float *r, *g, *b, *nx, *ny, *nz, *depth, *ar, *ag, *ab;
+
+    row_planes(const denoise_buffers &buf, const float *const color[3], size_t offset)
+        : r(color[0] + offset), g(color[1] + offset), b(color[2] + offset)
+        , nx(buf.nx.data() + offset), ny(buf.ny.data() + offset), nz(buf.nz.data() + offset), depth(buf.depth.data() + offset)
+        , ar(buf.ar.data() + offset), ag(buf.ag.data() + offset), ab(buf.ab.data() + offset) {}
+};
+
+/**
+ * Adds the n pixels of tap row t, with kernel weight h, to those of center row c.
+ * The outputs are restrict parameters, so the compiler needs no alias checks
+ * against the twenty input streams. The exponents are clamped in a loop of
+ * their own: followed by the exp2 the clamp is compiled to a branch, and a
+ * loop with a branch does not vectorize.
+ */
+DENOISE_AVX2_CLONE
+void add_tap(const row_planes &c, const row_planes &t, int n, float h, const filter_pass &pass, float *__restrict e,
+             float *__restrict acc_r, float *__restrict acc_g, float *__restrict acc_b, float *__restrict acc_w) {
+    const float color_k = pass.color_k, normal_k = pass.normal_k, depth_k = pass.depth_k, albedo_k = pass.albedo_k;
+    for (int x = 0; x < n; ++x) {
+        const float dr = t.r[x] - c.r[x], dg = t.g[x] - c.g[x], db = t.b[x] - c.b[x];
+        const float enx = t.nx[x] - c.nx[x], eny = t.ny[x] - c.ny[x], enz = t.nz[x] - c.nz[x];
+        const float ed = (t.depth[x] - c.depth[x]) / (c.depth[x] + 1e-3f);
+        const float ear = t.ar[x] - c.ar[x], eag = t.ag[x] - c.ag[x], eab = t.ab[x] - c.ab[x];
+        const float sum = (dr * dr + dg * dg + db * db) * color_k + (enx * enx + eny * eny + enz * enz) * normal_k
+                        + ed * ed * depth_k + (ear * ear + eag * eag + eab * eab) * albedo_k;
+        e[x] = std::min(sum, 64.f);     // below 2^-64 weights and their sums would go denormal, which is many times slower
+    }
+    for (int x = 0; x < n; ++x) {
+        const float w = h * exp2_negative(e[x]);
+        acc_r[x] += w * t.r[x];
+        acc_g[x] += w * t.g[x];
+        acc_b[x] += w * t.b[x];
+        acc_w[x] += w;
+    }
+}
+
+// One row of one a-trous iteration.
+void filter_row(const filter_pass &pass, int y, row_scratch &s) {
+    static const float kernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+    const denoise_buffers &buf = *pass.guides;
+    const int width = buf.width, height = buf.height;
+    std::fill(s.r.begin(), s.r.end(), 0.f);
+    std::fill(s.g.begin(), s.g.end(), 0.f);
+    std::fill(s.b.begin(), s.b.end(), 0.f);
+    std::fill(s.w.begin(), s.w.end(), 0.f);
+
+    const size_t row = size_t(y) * width;
+    for (int ky = 0; ky < 5; ++ky) {
+        const int yy = y + (ky - 2) * pass.step;
+        if (yy < 0 || yy >= height)
+            continue;       // taps off the image drop out, the weights renormalize
+        for (int kx = 0; kx < 5; ++kx) {
+            const int dx = (kx - 2) * pass.step;
+            const int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+            add_tap(row_planes(buf, pass.in, row + x0), row_planes(buf, pass.in, size_t(yy) * width + x0 + dx),
+                    x1 - x0, kernel[kx] * kernel[ky], pass, s.e.data(), &s.r[size_t(x0)], &s.g[size_t(x0)], &s.b[size_t(x0)], &s.w[size_t(x0)]);
+        }
+    }
+    // The center tap always has weight, so acc_w > 0.
+    for (int x = 0; x < width; ++x) {
+        const float inv = 1.f / s.w[size_t(x)];
+        pass.out[0][row + x] = s.r[size_t(x)] * inv;
+        pass.out[1][row + x] = s.g[size_t(x)] * inv;
+        pass.out[2][row + x] = s.b[size_t(x)] * inv;
+    }
+}
+
+} // namespace
+
+constexpr float denoise_buffers::miss_depth;
+
+denoise_buffers::denoise_buffers(int w, int h) : width(w), height(h) {
+    const size_t n = size_t(w) * h;
+    for (std::vector<float> *plane : { &r, &g, &b, &nx, &ny, &nz, &ar, &ag, &ab })
+        plane->assign(n, 0.f);
+    depth.assign(n, miss_depth);
+}
+
+void denoise(denoise_buffers &buf, const denoise_settings &settings, thread_pool &pool) {
+    const float log2e = 1.44269504f;
+    const size_t n = size_t(buf.width) * buf.height;
+    std::vector<float> tr(n), tg(n), tb(n);
+    std::vector<row_scratch> scratch(pool.size());
+    for (row_scratch &s : scratch) {
+        s.r.resize(size_t(buf.width));
+        s.g.resize(size_t(buf.width));
+        s.b.resize(size_t(buf.width));
+        s.w.resize(size_t(buf.width));
+        s.e.resize(size_t(buf.width));
+    }
+
+    float *planes[2][3] = { { buf.r.data(), buf.g.data(), buf.b.data() }, { tr.data(), tg.data(), tb.data() } };
+    float sigma_color = settings.sigma_color;
+    for (int i = 0; i < settings.iterations; ++i) {
+        filter_pass pass;
+        pass.guides = &buf;
+        pass.in = planes[i % 2];
+        pass.out = planes[(i + 1) % 2];
+        pass.step = 1 << i;
+        pass.color_k = log2e / (sigma_color * sigma_color);
+        pass.normal_k = log2e / (settings.sigma_normal * settings.sigma_normal);
+        pass.depth_k = log2e / (settings.sigma_depth * settings.sigma_depth);
+        pass.albedo_k = log2e / (settings.sigma_albedo * settings.sigma_albedo);
+        pool.parallel_for(size_t(buf.height), [&](size_t y, size_t thread) {
+            filter_row(pass, int(y), scratch[thread]);
+        });
+        sigma_color *= 0.5f;        // later iterations average over wider areas, so only smaller differences are noise
+    }
+    if (settings.iterations % 2) {
+        buf.r.swap(tr);
+        buf.g.swap(tg);
+        buf.b.swap(tb);
+    }
+}
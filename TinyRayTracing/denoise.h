@@ -0,0 +1,55 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "geometry.h"
+#include "thread_pool.h"
+
+/**
+ * Color and the guides the denoiser needs, one plane per channel so the
+ * filter runs over contiguous floats. The guides describe the primary hit
+ * of each pixel's center sample.
+ */
+struct denoise_buffers {
+    int width, height;
+    std::vector<float> r, g, b;
+    std::vector<float> nx, ny, nz;      // shading normal, 0 where the ray missed
+    std::vector<float> depth;           // hit distance, miss_depth where the ray missed
+    std::vector<float> ar, ag, ab;      // diffuse color, textures included
+
+    static constexpr float miss_depth = 1e6f;
+
+    denoise_buffers(int w, int h);
+
+    void set_color(size_t p, const vec3 &c) { r[p] = c.x; g[p] = c.y; b[p] = c.z; }
+    vec3 color(size_t p) const { return vec3(r[p], g[p], b[p]); }
+    void set_guides(size_t p, const vec3 &normal, float hit_depth, const vec3 &albedo) {
+        nx[p] = normal.x; ny[p] = normal.y; nz[p] = normal.z;
+        depth[p] = hit_depth;
+        ar[p] = albedo.x; ag[p] = albedo.y; ab[p] = albedo.z;
+    }
+};
+
+struct denoise_settings {
+    int   iterations   = 5;         // the filter reaches 2^(iterations + 1) - 2 pixels out
+    float sigma_color  = 0.25f;     // halved every iteration
+    float sigma_normal = 0.3f;      // on the squared distance of unit normals
+    float sigma_depth  = 0.05f;     // relative to the pixel's own depth
+    float sigma_albedo = 0.1f;
+};
+
+/**
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al., 2010) on the color
+ * planes of buf. Each iteration blends a 5x5 B3-spline kernel whose taps are
+ * 2^i pixels apart, weighted down where color, normal, depth or albedo of a
+ * tap differ from the center pixel's, so edges and texture detail the guides
+ * see survive while noise within a surface is smoothed out.
+ *
+ * Rows are spread over pool; every tap is one loop over a row span without
+ * branches, which the compiler vectorizes, for AVX2 too where it can.
+ */
+void denoise(denoise_buffers &buf, const denoise_settings &settings, thread_pool &pool);
+
+#endif
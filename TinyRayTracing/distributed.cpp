@@ -0,0 +1,530 @@
+#include "distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+enum message_type : uint32_t {
+    msg_hello = 1,      // worker -> coordinator, carries the fingerprint
+    msg_reject,         // coordinator -> worker, the fingerprints differ
+    msg_tile,           // coordinator -> worker, render this rectangle
+    msg_result,         // worker -> coordinator, followed by the tile's linear RGB floats
+    msg_done            // coordinator -> worker, nothing left
+};
+
+// Every message is one of these. Both ends run the same binary on the same machine, so it is sent as is.
+struct message {
+    uint32_t type;
+    uint32_t tile;
+    int32_t  x0, y0, x1, y1;
+    uint64_t fingerprint;
+};
+
+size_t tile_floats(const message &m) {
+    return size_t(m.x1 - m.x0) * size_t(m.y1 - m.y0) * 3;
+}
+
+// FNV-1a over everything that decides the pixels, so a worker started with other arguments is caught.
+struct fingerprint {
+    uint64_t hash = 14695981039346656037ull;
+
+    void add(const void *data, size_t size) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= p[i];
+            hash *= 1099511628211ull;
+        }
+    }
+    template <class T> void add(const T &value) { add(&value, sizeof value); }
+    template <class T> void add(const std::vector<T> &values) {
+        add(values.size());
+        if (!values.empty())
+            add(values.data(), values.size() * sizeof(T));
+    }
+};
+
+uint64_t render_fingerprint(const scene &sc, const render_options &opts) {
+    fingerprint f;
+    f.add(opts.width);
+    f.add(opts.height);
+    f.add(opts.cam.position);
+    f.add(opts.cam.target);
+    f.add(opts.cam.up);
+    f.add(opts.cam.fov);
+    f.add(opts.crop_x0);
+    f.add(opts.crop_y0);
+    f.add(opts.crop_x1);
+    f.add(opts.crop_y1);
+    const trace_settings &s = opts.settings;
+    f.add(s.max_depth);
+    f.add(s.min_weight);
+    f.add(s.roulette);
+    f.add(s.roulette_depth);
+    f.add(s.roulette_weight);
+    f.add(s.fast_math);
+    f.add(s.light_samples);
+    f.add(sc.materials);
+    f.add(sc.spheres);
+    f.add(sc.lights);
+    f.add(sc.planes);
+    f.add(sc.boxes);
+    f.add(sc.quadrics);
+    for (uint32_t i = 0; i < sc.textures.size(); ++i) {
+        const std::string &path = sc.textures.path(i);
+        f.add(path.data(), path.size());
+        f.add(sc.textures[i].width());
+        f.add(sc.textures[i].height());
+        f.add(sc.textures[i].first_level());
+    }
+    f.add(sc.environment);
+    f.add(sc.environment_intensity);
+    for (const mesh &m : sc.meshes) {
+        f.add(m.px); f.add(m.py); f.add(m.pz);
+        f.add(m.nx); f.add(m.ny); f.add(m.nz);
+        f.add(m.indices);
+        f.add(m.material_id);
+    }
+    return f.hash;
+}
+
+// Blocking write of all of data; false once the other end is gone.
+bool send_all(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+        const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+// Blocking read of exactly size bytes; false on end of stream or error.
+bool recv_all(int fd, void *data, size_t size) {
+    char *p = static_cast<char *>(data);
+    while (size > 0) {
+        const ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool send_message(int fd, uint32_t type, uint32_t tile = 0, int x0 = 0, int y0 = 0, int x1 = 0, int y1 = 0, uint64_t fp = 0) {
+    const message m = { type, tile, x0, y0, x1, y1, fp };
+    return send_all(fd, &m, sizeof m);
+}
+
+bool socket_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof addr.sun_path)
+        return false;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// The worker side of the protocol on a connected socket.
+int serve_tiles(const scene &sc, const render_options &opts, int fd) {
+    if (!send_message(fd, msg_hello, 0, 0, 0, opts.width, opts.height, render_fingerprint(sc, opts))) {
+        std::cerr << "worker: lost the coordinator" << std::endl;
+        return 1;
+    }
+    tile_renderer renderer(sc, opts);
+    std::vector<float> rgb;
+    message m;
+    while (recv_all(fd, &m, sizeof m)) {
+        if (m.type == msg_done)
+            return 0;
+        if (m.type == msg_reject) {
+            std::cerr << "worker: the coordinator renders a different scene, view or settings" << std::endl;
+            return 1;
+        }
+        if (m.type != msg_tile || m.x0 < 0 || m.y0 < 0 || m.x0 >= m.x1 || m.y0 >= m.y1
+            || m.x1 > opts.width || m.y1 > opts.height) {
+            std::cerr << "worker: bad message from the coordinator" << std::endl;
+            return 1;
+        }
+        rgb.resize(tile_floats(m));
+        renderer.render(m.x0, m.y0, m.x1, m.y1, rgb.data());
+        m.type = msg_result;
+        if (!send_all(fd, &m, sizeof m) || !send_all(fd, rgb.data(), rgb.size() * sizeof(float)))
+            break;
+    }
+    std::cerr << "worker: lost the coordinator" << std::endl;
+    return 1;
+}
+
+struct worker_link {
+    int   fd;
+    pid_t pid;                          // forked worker, -1 for one that connected
+    std::string name;
+    bool  greeted = false;
+    bool  lost = false;
+    std::vector<unsigned char> input;   // received, not parsed yet
+    std::vector<uint32_t> assigned;     // sent and not returned, oldest first
+    size_t tiles = 0;                   // returned
+
+    worker_link(int f, pid_t p, const std::string &n) : fd(f), pid(p), name(n) {}
+};
+
+/**
+ * Deals out the tiles in row-major order and collects the results into
+ * bands, which are written out as soon as they and all bands above them
+ * are complete. Tiles of a lost worker go to the front of the queue.
+ */
+class coordinator {
+public:
+    coordinator(const scene &sc, const render_options &opts, const distributed_options &dist)
+        : sc_(sc), opts_(opts), dist_(dist), fingerprint_(render_fingerprint(sc, opts)),
+          tiles_x_((opts.width + dist.tile_size - 1) / dist.tile_size),
+          tiles_y_((opts.height + dist.tile_size - 1) / dist.tile_size),
+          band_left_(size_t(tiles_y_), uint32_t(tiles_x_)), bands_(size_t(tiles_y_)),
+          done_(size_t(tiles_x_) * tiles_y_, false) {
+        for (uint32_t t = 0; t < done_.size(); ++t)
+            pending_.push_back(t);
+    }
+
+    ~coordinator() {
+        for (worker_link &link : links_) {
+            if (link.fd >= 0) {
+                send_message(link.fd, msg_done);
+                close(link.fd);
+            }
+        }
+        for (const worker_link &link : links_) {
+            if (link.pid > 0)
+                waitpid(link.pid, nullptr, 0);
+        }
+        if (listener_ >= 0) {
+            close(listener_);
+            unlink(dist_.listen.c_str());
+        }
+    }
+
+    // Before anything starts threads, so the children are plain copies of this process.
+    void fork_workers() {
+        std::cout.flush();
+        for (int i = 0; i < dist_.workers; ++i) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                std::cerr << "socketpair: " << strerror(errno) << std::endl;
+                break;
+            }
+            const pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                for (const worker_link &link : links_)
+                    close(link.fd);
+                _exit(serve_tiles(sc_, opts_, fds[1]));
+            }
+            close(fds[1]);
+            if (pid < 0) {
+                std::cerr << "fork: " << strerror(errno) << std::endl;
+                close(fds[0]);
+                break;
+            }
+            links_.emplace_back(fds[0], pid, "worker " + std::to_string(i) + " (pid " + std::to_string(pid) + ")");
+        }
+    }
+
+    // Throws image_error when the socket cannot be set up.
+    void listen_at(const std::string &path) {
+        sockaddr_un addr;
+        if (!socket_address(path, addr))
+            throw image_error("bad socket path " + path);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path.c_str());       // left over from an earlier run
+        listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener_ < 0 || bind(listener_, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) != 0
+            || ::listen(listener_, 16) != 0) {
+            const std::string reason = strerror(errno);
+            if (listener_ >= 0)
+                close(listener_);
+            listener_ = -1;
+            throw image_error("cannot listen on " + path + ": " + reason);
+        }
+    }
+
+    // Throws image_error when writing fails.
+    void run(image_writer &out) {
+        std::vector<pollfd> fds;
+        bool announced = false;
+        while (next_band_ < tiles_y_) {
+            dispatch();
+            if (live_links() == 0 && listener_ < 0) {
+                render_locally(out);
+                break;
+            }
+            if (live_links() == 0 && !announced) {
+                std::cout << "waiting for workers on " << dist_.listen << std::endl;
+                announced = true;
+            }
+
+            fds.clear();
+            if (listener_ >= 0)
+                fds.push_back(pollfd{listener_, POLLIN, 0});
+            for (const worker_link &link : links_) {
+                if (link.fd >= 0)
+                    fds.push_back(pollfd{link.fd, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw image_error(std::string("poll: ") + strerror(errno));
+            }
+
+            size_t f = 0;
+            if (listener_ >= 0 && fds[f++].revents) {
+                const int fd = accept(listener_, nullptr, nullptr);
+                if (fd >= 0)
+                    links_.emplace_back(fd, pid_t(-1), "client " + std::to_string(clients_++));
+            }
+            for (size_t i = 0; i < links_.size() && f < fds.size(); ++i) {
+                if (links_[i].fd != fds[f].fd)
+                    continue;
+                if (fds[f++].revents)
+                    receive(links_[i], out);
+            }
+        }
+        out.finish();
+    }
+
+    void report(double seconds) const {
+        std::cout << "distributed: " << done_.size() << " tiles of " << dist_.tile_size << " px in " << seconds
+                  << " s, " << reissued_ << " reissued" << std::endl;
+        for (const worker_link &link : links_) {
+            if (link.greeted || link.tiles > 0)
+                std::cout << "  " << link.name << ": " << link.tiles << " tiles" << (link.lost ? ", lost" : "") << std::endl;
+        }
+        if (local_tiles_ > 0)
+            std::cout << "  coordinator: " << local_tiles_ << " tiles" << std::endl;
+    }
+
+private:
+    size_t live_links() const {
+        size_t n = 0;
+        for (const worker_link &link : links_)
+            n += link.fd >= 0;
+        return n;
+    }
+
+    void tile_rect(uint32_t tile, int &x0, int &y0, int &x1, int &y1) const {
+        x0 = int(tile % uint32_t(tiles_x_)) * dist_.tile_size;
+        y0 = int(tile / uint32_t(tiles_x_)) * dist_.tile_size;
+        x1 = std::min(x0 + dist_.tile_size, opts_.width);
+        y1 = std::min(y0 + dist_.tile_size, opts_.height);
+    }
+
+    // Tops up every worker to tiles_in_flight.
+    void dispatch() {
+        for (worker_link &link : links_) {
+            while (link.fd >= 0 && link.greeted && !pending_.empty() && int(link.assigned.size()) < dist_.tiles_in_flight) {
+                const uint32_t tile = pending_.front();
+                int x0, y0, x1, y1;
+                tile_rect(tile, x0, y0, x1, y1);
+                if (!send_message(link.fd, msg_tile, tile, x0, y0, x1, y1)) {
+                    lose(link, "lost");
+                    break;
+                }
+                pending_.pop_front();
+                link.assigned.push_back(tile);
+            }
+        }
+    }
+
+    void lose(worker_link &link, const char *why) {
+        std::cerr << link.name << ": " << why;
+        if (!link.assigned.empty())
+            std::cerr << ", reissuing " << link.assigned.size() << " tiles";
+        std::cerr << std::endl;
+        pending_.insert(pending_.begin(), link.assigned.begin(), link.assigned.end());
+        reissued_ += link.assigned.size();
+        link.assigned.clear();
+        link.lost = true;
+        close(link.fd);
+        link.fd = -1;
+    }
+
+    void receive(worker_link &link, image_writer &out) {
+        unsigned char buffer[65536];
+        const ssize_t n = recv(link.fd, buffer, sizeof buffer, MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            lose(link, "lost");
+            return;
+        }
+        link.input.insert(link.input.end(), buffer, buffer + n);
+
+        size_t used = 0;
+        while (link.input.size() - used >= sizeof(message)) {
+            message m;
+            memcpy(&m, link.input.data() + used, sizeof m);
+            if (m.type == msg_hello && !link.greeted) {
+                used += sizeof m;
+                if (m.fingerprint != fingerprint_) {
+                    send_message(link.fd, msg_reject);
+                    std::cerr << link.name << ": different scene, view or settings, turned away" << std::endl;
+                    close(link.fd);
+                    link.fd = -1;
+                    return;
+                }
+                link.greeted = true;
+                continue;
+            }
+            const std::vector<uint32_t>::iterator at = std::find(link.assigned.begin(), link.assigned.end(), m.tile);
+            int x0, y0, x1, y1;
+            if (m.type == msg_result && at != link.assigned.end())
+                tile_rect(m.tile, x0, y0, x1, y1);
+            if (m.type != msg_result || at == link.assigned.end() || m.x0 != x0 || m.y0 != y0 || m.x1 != x1 || m.y1 != y1) {
+                lose(link, "protocol error");
+                return;
+            }
+            const size_t tile_bytes = tile_floats(m) * sizeof(float);
+            if (link.input.size() - used < sizeof m + tile_bytes)
+                break;
+            tile_.resize(tile_floats(m));
+            memcpy(tile_.data(), link.input.data() + used + sizeof m, tile_bytes);      // input is not aligned for floats
+            store(m, tile_.data(), out);
+            used += sizeof m + tile_bytes;
+            link.assigned.erase(at);
+            ++link.tiles;
+        }
+        link.input.erase(link.input.begin(), link.input.begin() + used);
+    }
+
+    // Copies a finished tile into its band and writes out whatever bands are complete.
+    void store(const message &m, const float *rgb, image_writer &out) {
+        if (done_[m.tile])
+            return;
+        done_[m.tile] = true;
+        const int band = m.y0 / dist_.tile_size;
+        const size_t row_values = size_t(opts_.width) * 3;
+        std::vector<float> &pixels = bands_[size_t(band)];
+        if (pixels.empty())
+            pixels.resize(row_values * size_t(std::min(dist_.tile_size, opts_.height - m.y0)));
+        const size_t tile_row = size_t(m.x1 - m.x0) * 3;
+        for (int y = m.y0; y < m.y1; ++y)
+            memcpy(&pixels[size_t(y - m.y0) * row_values + size_t(m.x0) * 3], rgb + size_t(y - m.y0) * tile_row, tile_row * sizeof(float));
+        --band_left_[size_t(band)];
+
+        while (next_band_ < tiles_y_ && band_left_[size_t(next_band_)] == 0) {
+            std::vector<float> &rows = bands_[size_t(next_band_)];
+            write_linear_rows(out, rows.data(), opts_.width, int(rows.size() / row_values), opts_.tone, bytes_);
+            std::vector<float>().swap(rows);
+            ++next_band_;
+        }
+    }
+
+    // Nobody is left to hand tiles to.
+    void render_locally(image_writer &out) {
+        std::cerr << "no workers left, rendering " << pending_.size() << " tiles here" << std::endl;
+        tile_renderer renderer(sc_, opts_);
+        std::vector<float> rgb;
+        while (!pending_.empty()) {
+            message m = { msg_result, pending_.front(), 0, 0, 0, 0, 0 };
+            pending_.pop_front();
+            tile_rect(m.tile, m.x0, m.y0, m.x1, m.y1);
+            rgb.resize(tile_floats(m));
+            renderer.render(m.x0, m.y0, m.x1, m.y1, rgb.data());
+            store(m, rgb.data(), out);
+            ++local_tiles_;
+        }
+    }
+
+    const scene &sc_;
+    const render_options &opts_;
+    const distributed_options &dist_;
+    const uint64_t fingerprint_;
+    const int tiles_x_, tiles_y_;
+
+    std::vector<worker_link> links_;
+    int listener_ = -1;
+    int clients_ = 0;
+
+    std::deque<uint32_t> pending_;
+    std::vector<uint32_t> band_left_;                   // tiles per band still missing
+    std::vector<std::vector<float>> bands_;             // allocated by the first tile to arrive
+    std::vector<float> tile_;                           // a received tile
+    std::vector<unsigned char> bytes_;                  // a tone mapped band
+    std::vector<bool> done_;
+    int next_band_ = 0;                                 // first band not written yet
+
+    size_t reissued_ = 0;
+    size_t local_tiles_ = 0;
+};
+
+} // namespace
+
+int render_distributed(const scene &sc, const render_options &opts, const distributed_options &dist) {
+    typedef std::chrono::steady_clock clock;
+    const clock::time_point start = clock::now();
+    try {
+        coordinator coord(sc, opts, dist);
+        coord.fork_workers();
+        if (!dist.listen.empty())
+            coord.listen_at(dist.listen);
+        std::unique_ptr<image_writer> out = open_image_writer(opts.output, opts.width, opts.height, opts.threads);
+        coord.run(*out);
+        coord.report(std::chrono::duration<double>(clock::now() - start).count());
+    } catch (const image_error &e) {
+        std::cerr << e.what() << std::endl;
+        std::cout << "failed!" << std::endl;
+        return 1;
+    }
+    std::cout << "success!" << std::endl;
+    return 0;
+}
+
+int run_worker(const scene &sc, const render_options &opts, const std::string &socket_path) {
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr)) {
+        std::cerr << "bad socket path " << socket_path << std::endl;
+        return 1;
+    }
+    // The coordinator may still be loading its scene, so give it a few seconds to come up.
+    for (int attempt = 0;; ++attempt) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            std::cerr << "socket: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) == 0) {
+            const int code = serve_tiles(sc, opts, fd);
+            close(fd);
+            return code;
+        }
+        const int error = errno;
+        close(fd);
+        if ((error != ENOENT && error != ECONNREFUSED) || attempt == 50) {
+            std::cerr << "cannot connect to " << socket_path << ": " << strerror(error) << std::endl;
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
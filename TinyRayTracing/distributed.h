@@ -0,0 +1,43 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <string>
+
+#include "renderer.h"
+#include "scene.h"
+
+/**
+ * Tile rendering spread over worker processes on one machine.
+ *
+ * The coordinator cuts the image into tiles and deals them out to workers
+ * over Unix domain sockets: a worker announces itself, is sent up to
+ * tiles_in_flight tiles, and asks for the next one by returning a result.
+ * Finished bands go to the image writer in order, as with render(), and the
+ * pixels are the ones render() makes. When a worker goes away
+ * its outstanding tiles are dealt out again; when none are left, the
+ * coordinator renders the rest itself.
+ *
+ * Workers are either forked by the coordinator, sharing its scene, or are
+ * separate processes started with the same scene and view options and
+ * --connect to the coordinator's --listen socket. Each renders on one
+ * thread, so a machine wants about one per core. A worker whose scene,
+ * view or settings differ from the coordinator's is turned away.
+ */
+struct distributed_options {
+    int workers = 0;            // processes to fork
+    std::string listen;         // socket path for external workers, empty = none
+    int tile_size = 64;
+    int tiles_in_flight = 2;    // per worker, so it never waits for the next tile
+};
+
+/**
+ * Coordinates a single sample render of sc to opts.output; the acceleration
+ * structure must be built. Prints the tiles each worker rendered and
+ * "success!" or "failed!". Returns the exit code.
+ */
+int render_distributed(const scene &sc, const render_options &opts, const distributed_options &dist);
+
+// Renders tiles for the coordinator listening at socket_path until it says it is done. Returns the exit code.
+int run_worker(const scene &sc, const render_options &opts, const std::string &socket_path);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "geometry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRT_HAVE_SSE_RSQRT 1
+#endif
+
+/**
+ * Math policies for shading, passed as a template argument so the choice
+ * costs nothing per call. math_exact is what the renderer always did;
+ * math_fast trades a little accuracy for speed:
+ *
+ *   rsqrt  hardware estimate (12 bits) plus one Newton step, 3e-7 relative
+ *   pow    exp2(y * log2(x)) with polynomial log2 and exp2; the error grows
+ *          with the exponent, 2e-6 relative at y = 1.5 and 2e-5 at y = 1425
+ *
+ * The fast kernels are branch free apart from range clamps, so the compiler
+ * can vectorize them over packet lanes. --math-error measures what they cost
+ * in image quality for a given scene.
+ */
+
+struct math_exact {
+    static float rsqrt(float x) { return 1.f / std::sqrt(x); }
+    static float sqrt(float x) { return std::sqrt(x); }
+    static float pow(float x, float y) { return powf(x, y); }
+};
+
+namespace fast_math_detail {
+
+inline float bits_to_float(uint32_t u) { float f; memcpy(&f, &u, 4); return f; }
+inline uint32_t float_to_bits(float f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+
+// 1 / sqrt(x) for normal, positive x.
+inline float rsqrt(float x) {
+#ifdef TRT_HAVE_SSE_RSQRT
+    const float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+    const float r = bits_to_float(0x5f375a86u - (float_to_bits(x) >> 1));
+#endif
+    return r * (1.5f - 0.5f * x * r * r);
+}
+
+// log2(x) for normal, positive x: exponent plus an odd series in (m - 1) / (m + 1), m in [sqrt(1/2), sqrt(2)).
+inline float log2(float x) {
+    const uint32_t bits = float_to_bits(x);
+    int e = int(bits >> 23) - 127;
+    float m = bits_to_float((bits & 0x007fffffu) | 0x3f800000u);     // [1, 2)
+    const bool high = m > 1.41421356f;
+    m = high ? m * 0.5f : m;
+    e += high;
+    const float t = (m - 1.f) / (m + 1.f), t2 = t * t;
+    const float ln_m = 2.f * t * (1.f + t2 * (1.f / 3 + t2 * (1.f / 5 + t2 * (1.f / 7))));
+    return float(e) + ln_m * 1.44269504f;
+}
+
+// 2^x, flushed to 2^-126 below the normal range and clamped above it.
+inline float exp2(float x) {
+    x = x < -126.f ? -126.f : x > 127.f ? 127.f : x;
+    const float k = std::floor(x + 0.5f);
+    const float f = (x - k) * 0.69314718f;                          // [-ln 2 / 2, ln 2 / 2]
+    const float p = 1.f + f * (1.f + f * (1.f / 2 + f * (1.f / 6 + f * (1.f / 24 + f * (1.f / 120 + f * (1.f / 720))))));
+    return p * bits_to_float(uint32_t(int(k) + 127) << 23);
+}
+
+} // namespace fast_math_detail
+
+struct math_fast {
+    // x > 0; the estimate's 1/0 = inf would turn into NaN in the Newton step.
+    static float rsqrt(float x) { return fast_math_detail::rsqrt(x); }
+    static float sqrt(float x) { return x > 0 ? x * fast_math_detail::rsqrt(x) : 0.f; }
+    // x >= 0 as for the specular term.
+    static float pow(float x, float y) {
+        if (!(x > 1.17549435e-38f))
+            return y == 0 ? 1.f : 0.f;
+        return fast_math_detail::exp2(y * fast_math_detail::log2(x));
+    }
+};
+
+// v / |v|; with math_exact the same as vec3::normalized().
+template <class Math>
+inline vec3 normalize(const vec3 &v) {
+    return v * Math::rsqrt(v * v);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+struct vec3 {
+    float x = 0, y = 0, z = 0;
+    vec3() = default;
+    vec3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+    float& operator[] (const int i) { return i == 0 ? x : i == 1 ? y : z; }
+    const float& operator[] (const int i) const { return i == 0 ? x : i == 1 ? y : z; }
+    vec3  operator*(const float v) const { return vec3(x * v, y * v, z * v); }
+    float operator*(const vec3& v) const { return x*v.x + y*v.y + z*v.z; }
+    vec3  operator+(const vec3& v) const { return vec3(x + v.x, y + v.y, z + v.z); }
+    vec3  operator-(const vec3& v) const { return vec3(x - v.x, y - v.y, z - v.z); }
+    vec3  operator-()              const { return vec3(-x, -y, -z); }
+    float norm() const { return std::sqrt(x*x + y*y + z*z);}
+    vec3 normalized() const { return (*this)*(1.f/norm()); }
+};
+
+inline vec3 cross(const vec3 v1, const vec3 v2) {
+    return vec3( v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x );
+}
+
+inline vec3 reflect(const vec3 &I, const vec3 &N) {
+    return I - N * 2.f * (I * N);
+}
+
+inline vec3 refract(const vec3 &I, const vec3 &N, const float &refractive_index) {
+    float cosi = -std::max(-1.f, std::min(1.f, I * N)); // 计算入射光线与法线的点积，负号用于调整方向，使内积为负时表示光线在物体内部。
+    float etai = 1, etat = refractive_index;           // etai为入射介质的折射率（空气通常为1），etat为目标介质的折射率。
+    vec3 n = N;
+    if (cosi < 0) {
+        cosi = -cosi;
+        std::swap(etai, etat); n = -N;                 // 交换折射率，因为光线从目标介质进入入射介质，同时反转法线的方向。
+    }
+    float eta = etai / etat;
+    float k = 1 - eta * eta * (1 - cosi * cosi);       // 这里 k 用于判断是否发生全反射。
+    return k < 0 ? vec3(0, 0, 0) : I * eta + n * (eta * cosi - sqrtf(k)); 
+}
+
+struct aabb {
+    vec3 min = vec3( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    vec3 max = vec3(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+    void expand(const vec3 &p) {
+        min = vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+    void expand(const aabb &b) {
+        min = vec3(std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z));
+        max = vec3(std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z));
+    }
+    vec3 centroid() const { return (min + max) * 0.5f; }
+    float area() const {
+        vec3 d = max - min;
+        return d.x < 0 ? 0 : 2.f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+#endif
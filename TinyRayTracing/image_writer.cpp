@@ -0,0 +1,550 @@
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "image_writer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace {
+
+std::string lower_extension(const std::string &path) {
+    const size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || path.find_first_of("/\\", dot) != std::string::npos)
+        return "";
+    std::string ext = path.substr(dot + 1);
+    for (char &c : ext)
+        c = char(tolower(c));
+    return ext;
+}
+
+class stream_file {
+public:
+    explicit stream_file(const std::string &path) : path_(path), out_(path, std::ios::binary) {
+        if (!out_)
+            throw image_error(path + ": cannot open for writing");
+    }
+    void write(const void *data, size_t size) {
+        out_.write(static_cast<const char*>(data), std::streamsize(size));
+        if (!out_)
+            throw image_error(path_ + ": write failed");
+    }
+    void seek(size_t offset) {
+        out_.seekp(std::streamoff(offset));
+        if (!out_)
+            throw image_error(path_ + ": seek failed");
+    }
+    void close() {
+        out_.close();
+        if (!out_)
+            throw image_error(path_ + ": write failed");
+    }
+
+private:
+    std::string path_;
+    std::ofstream out_;
+};
+
+// ---------------------------------------------------------------------------
+// PPM (P6): a short header followed by the raw rows.
+
+class ppm_writer : public image_writer {
+public:
+    ppm_writer(const std::string &path, int width, int height) : file_(path), row_bytes_(size_t(width) * 3) {
+        const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        file_.write(header.data(), header.size());
+    }
+    void write_rows(const unsigned char *rows, int count) override { file_.write(rows, row_bytes_ * count); }
+    void finish() override { file_.close(); }
+
+private:
+    stream_file file_;
+    size_t row_bytes_;
+};
+
+// ---------------------------------------------------------------------------
+// PFM (PF): a short header and raw little- or big-endian floats, as the sign
+// of the scale says, rows stored from the bottom up. The header fixes where
+// every row goes, so a band is written reversed at its place in the file.
+
+class pfm_writer : public image_writer {
+public:
+    pfm_writer(const std::string &path, int width, int height) : file_(path), width_(width), height_(height) {
+        const uint16_t probe = 1;
+        const bool little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+        const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + (little ? "\n-1.0\n" : "\n1.0\n");
+        file_.write(header.data(), header.size());
+        header_bytes_ = header.size();
+    }
+
+    bool takes_float() const override { return true; }
+
+    void write_float_rows(const float *rows, int count) override {
+        const size_t row_values = size_t(width_) * 3;
+        reversed_.resize(row_values * size_t(count));
+        for (int r = 0; r < count; ++r)
+            memcpy(&reversed_[size_t(count - 1 - r) * row_values], rows + size_t(r) * row_values, row_values * sizeof(float));
+        file_.seek(header_bytes_ + size_t(height_ - next_row_ - count) * row_values * sizeof(float));
+        file_.write(reversed_.data(), reversed_.size() * sizeof(float));
+        next_row_ += count;
+    }
+
+    // 8-bit rows, e.g. a heatmap, are stored as floats in [0, 1].
+    void write_rows(const unsigned char *rows, int count) override {
+        std::vector<float> values(size_t(width_) * 3 * size_t(count));
+        for (size_t i = 0; i < values.size(); ++i)
+            values[i] = rows[i] * (1.f / 255);
+        write_float_rows(values.data(), count);
+    }
+
+    void finish() override { file_.close(); }
+
+private:
+    stream_file file_;
+    int width_, height_;
+    size_t header_bytes_ = 0;
+    int next_row_ = 0;
+    std::vector<float> reversed_;
+};
+
+// ---------------------------------------------------------------------------
+// PNG. Every band becomes one IDAT chunk of fixed-Huffman deflate blocks, each
+// ending with a sync flush, so bands are compressed independently and nothing
+// but the last filtered row has to be kept between them. With a thread pool a
+// band is cut into strips that are filtered and compressed concurrently; the
+// strips' blocks simply follow each other in the chunk.
+
+struct crc_table {
+    uint32_t entry[256];
+    crc_table() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            entry[n] = c;
+        }
+    }
+};
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n) {
+    static const crc_table table;
+    for (size_t i = 0; i < n; ++i)
+        crc = table.entry[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// LSB-first bit packing as deflate wants it.
+class bit_writer {
+public:
+    explicit bit_writer(std::vector<unsigned char> &out) : out_(out) {}
+
+    void put(uint32_t value, int count) {
+        bits_ |= value << count_;
+        count_ += count;
+        while (count_ >= 8) {
+            out_.push_back(static_cast<unsigned char>(bits_));
+            bits_ >>= 8;
+            count_ -= 8;
+        }
+    }
+    // Huffman codes are defined most significant bit first.
+    void put_code(uint32_t code, int count) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < count; ++i)
+            reversed |= (code >> i & 1) << (count - 1 - i);
+        put(reversed, count);
+    }
+    void align() {
+        if (count_ > 0)
+            out_.push_back(static_cast<unsigned char>(bits_));
+        bits_ = 0;
+        count_ = 0;
+    }
+
+private:
+    std::vector<unsigned char> &out_;
+    uint32_t bits_ = 0;
+    int count_ = 0;
+};
+
+const int length_base[29]  = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const int dist_base[30]    = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                               1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const int dist_extra[30]   = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+void put_symbol(bit_writer &bw, int sym) {
+    if (sym < 144)      bw.put_code(0x30 + sym, 8);
+    else if (sym < 256) bw.put_code(0x190 + sym - 144, 9);
+    else if (sym < 280) bw.put_code(sym - 256, 7);
+    else                bw.put_code(0xc0 + sym - 280, 8);
+}
+
+void put_match(bit_writer &bw, int length, int dist) {
+    int l = 28;
+    while (length_base[l] > length)
+        --l;
+    put_symbol(bw, 257 + l);
+    bw.put(length - length_base[l], length_extra[l]);
+    int d = 29;
+    while (dist_base[d] > dist)
+        --d;
+    bw.put_code(d, 5);
+    bw.put(dist - dist_base[d], dist_extra[d]);
+}
+
+/**
+ * Appends data as one non-final fixed-Huffman block plus an empty stored
+ * block (a sync flush), so the output ends on a byte boundary. Greedy LZ77
+ * with a single-entry hash table over a 32K window inside data.
+ */
+void deflate_band(const unsigned char *data, size_t size, std::vector<unsigned char> &out) {
+    const int hash_bits = 15;
+    const size_t window = 32768, max_match = 258;
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    auto hash = [&](size_t i) { return ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - hash_bits); };
+
+    bit_writer bw(out);
+    bw.put(0, 1);       // BFINAL
+    bw.put(1, 2);       // BTYPE fixed Huffman
+    size_t i = 0;
+    while (i < size) {
+        if (i + 3 <= size) {
+            const uint32_t h = hash(i);
+            const int32_t candidate = head[h];
+            head[h] = int32_t(i);
+            if (candidate >= 0 && i - size_t(candidate) <= window) {
+                const size_t limit = std::min(max_match, size - i);
+                size_t len = 0;
+                while (len < limit && data[candidate + len] == data[i + len])
+                    ++len;
+                if (len >= 3) {
+                    put_match(bw, int(len), int(i - size_t(candidate)));
+                    for (size_t k = i + 1; k < i + len && k + 3 <= size; ++k)
+                        head[hash(k)] = int32_t(k);
+                    i += len;
+                    continue;
+                }
+            }
+        }
+        put_symbol(bw, data[i++]);
+    }
+    put_symbol(bw, 256);    // end of block
+
+    bw.put(0, 1);
+    bw.put(0, 2);
+    bw.align();
+    const unsigned char empty_stored[4] = { 0x00, 0x00, 0xff, 0xff };
+    out.insert(out.end(), empty_stored, empty_stored + 4);
+}
+
+const uint32_t adler_mod = 65521;
+
+void adler32_update(uint32_t &a, uint32_t &b, const unsigned char *p, size_t n) {
+    while (n > 0) {
+        const size_t chunk = std::min(n, size_t(5552));   // largest run before the sums can overflow
+        for (size_t i = 0; i < chunk; ++i) {
+            a += p[i];
+            b += a;
+        }
+        a %= adler_mod;
+        b %= adler_mod;
+        p += chunk;
+        n -= chunk;
+    }
+}
+
+// Appends the Adler-32 sums (a2, b2) of n further bytes, computed from the initial (1, 0), to (a, b).
+void adler32_combine(uint32_t &a, uint32_t &b, uint32_t a2, uint32_t b2, size_t n) {
+    const uint32_t rem = uint32_t(n % adler_mod);
+    b = uint32_t((b + b2 + uint64_t(rem) * (a + adler_mod - 1)) % adler_mod);
+    a = (a + a2 + adler_mod - 1) % adler_mod;
+}
+
+unsigned char paeth(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return static_cast<unsigned char>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+class png_writer : public image_writer {
+public:
+    png_writer(const std::string &path, int width, int height, size_t threads)
+        : file_(path), row_bytes_(size_t(width) * 3), prev_(row_bytes_, 0) {
+        if (threads != 1)
+            pool_.reset(new thread_pool(threads));
+        static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        file_.write(signature, 8);
+        unsigned char ihdr[13];
+        put_be32(ihdr, uint32_t(width));
+        put_be32(ihdr + 4, uint32_t(height));
+        ihdr[8] = 8;        // bit depth
+        ihdr[9] = 2;        // RGB
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+        write_chunk("IHDR", ihdr, 13);
+    }
+
+    void write_rows(const unsigned char *rows, int count) override {
+        if (count <= 0)
+            return;
+        const size_t strips = pool_ ? std::max<size_t>(1, std::min<size_t>(pool_->size(), count / min_strip_rows)) : 1;
+        if (strips_.size() < strips)
+            strips_.resize(strips);
+        auto encode = [&](size_t s, size_t) {
+            const int r0 = int(count * s / strips), r1 = int(count * (s + 1) / strips);
+            strip &st = strips_[s];
+            st.filtered.clear();
+            st.compressed.clear();
+            for (int r = r0; r < r1; ++r) {
+                const unsigned char *row = rows + r * row_bytes_;
+                filter_row(row, r == 0 ? prev_.data() : row - row_bytes_, st);
+            }
+            st.adler_a = 1;
+            st.adler_b = 0;
+            adler32_update(st.adler_a, st.adler_b, st.filtered.data(), st.filtered.size());
+            deflate_band(st.filtered.data(), st.filtered.size(), st.compressed);
+        };
+        if (strips == 1)
+            encode(0, 0);
+        else
+            pool_->parallel_for(strips, encode);
+        prev_.assign(rows + (count - 1) * row_bytes_, rows + count * row_bytes_);
+
+        compressed_.clear();
+        if (first_band_) {
+            compressed_.push_back(0x78);    // zlib header: deflate, 32K window
+            compressed_.push_back(0x01);
+            first_band_ = false;
+        }
+        for (size_t s = 0; s < strips; ++s) {
+            const strip &st = strips_[s];
+            adler32_combine(adler_a_, adler_b_, st.adler_a, st.adler_b, st.filtered.size());
+            compressed_.insert(compressed_.end(), st.compressed.begin(), st.compressed.end());
+        }
+        write_chunk("IDAT", compressed_.data(), compressed_.size());
+    }
+
+    void finish() override {
+        compressed_.clear();
+        if (first_band_) {
+            compressed_.push_back(0x78);
+            compressed_.push_back(0x01);
+        }
+        bit_writer bw(compressed_);
+        bw.put(1, 1);           // final, empty fixed-Huffman block
+        bw.put(1, 2);
+        put_symbol(bw, 256);
+        bw.align();
+        unsigned char adler[4];
+        put_be32(adler, adler_b_ << 16 | adler_a_);
+        compressed_.insert(compressed_.end(), adler, adler + 4);
+        write_chunk("IDAT", compressed_.data(), compressed_.size());
+        write_chunk("IEND", nullptr, 0);
+        file_.close();
+    }
+
+private:
+    // Fewer rows per strip lose too much of the match window to pay off.
+    static const int min_strip_rows = 4;
+
+    struct strip {
+        std::vector<unsigned char> filtered, compressed, candidate;
+        uint32_t adler_a, adler_b;
+    };
+
+    stream_file file_;
+    size_t row_bytes_;
+    std::vector<unsigned char> prev_, compressed_;
+    std::vector<strip> strips_;
+    std::unique_ptr<thread_pool> pool_;
+    uint32_t adler_a_ = 1, adler_b_ = 0;
+    bool first_band_ = true;
+
+    static void put_be32(unsigned char *p, uint32_t v) {
+        p[0] = static_cast<unsigned char>(v >> 24);
+        p[1] = static_cast<unsigned char>(v >> 16);
+        p[2] = static_cast<unsigned char>(v >> 8);
+        p[3] = static_cast<unsigned char>(v);
+    }
+
+    void write_chunk(const char *type, const unsigned char *data, size_t size) {
+        unsigned char header[8];
+        put_be32(header, uint32_t(size));
+        memcpy(header + 4, type, 4);
+        uint32_t crc = crc32_update(0xffffffffu, header + 4, 4);
+        crc = crc32_update(crc, data, size) ^ 0xffffffffu;
+        unsigned char trailer[4];
+        put_be32(trailer, crc);
+        file_.write(header, 8);
+        if (size > 0)
+            file_.write(data, size);
+        file_.write(trailer, 4);
+    }
+
+    // Appends the row to st.filtered with whichever filter gives the smallest sum of absolute residuals.
+    void filter_row(const unsigned char *row, const unsigned char *prev, strip &st) const {
+        const size_t bpp = 3;
+        st.candidate.resize(4 * row_bytes_);
+        unsigned char *sub = st.candidate.data(), *up = sub + row_bytes_, *avg = up + row_bytes_, *pae = avg + row_bytes_;
+        for (size_t i = 0; i < row_bytes_; ++i) {
+            const int a = i >= bpp ? row[i - bpp] : 0, b = prev[i], c = i >= bpp ? prev[i - bpp] : 0;
+            sub[i] = static_cast<unsigned char>(row[i] - a);
+            up[i]  = static_cast<unsigned char>(row[i] - b);
+            avg[i] = static_cast<unsigned char>(row[i] - (a + b) / 2);
+            pae[i] = static_cast<unsigned char>(row[i] - paeth(a, b, c));
+        }
+        const unsigned char *options[5] = { row, sub, up, avg, pae };
+        int best = 0;
+        uint64_t best_cost = ~uint64_t(0);
+        for (int f = 0; f < 5; ++f) {
+            uint64_t cost = 0;
+            for (size_t i = 0; i < row_bytes_; ++i)
+                cost += options[f][i] < 128 ? options[f][i] : 256 - options[f][i];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = f;
+            }
+        }
+        st.filtered.push_back(static_cast<unsigned char>(best));
+        st.filtered.insert(st.filtered.end(), options[best], options[best] + row_bytes_);
+    }
+};
+
+// ---------------------------------------------------------------------------
+// QOI ("Quite OK Image"): runs, a 64-entry cache of recent colors and small
+// deltas, one pass and no entropy coding. Several times faster to write than
+// our PNG and about as small on renders, for pipelines that re-encode anyway.
+
+class qoi_writer : public image_writer {
+public:
+    qoi_writer(const std::string &path, int width, int height) : file_(path), width_(width) {
+        unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+        for (int i = 0; i < 4; ++i) {
+            header[4 + i] = static_cast<unsigned char>(uint32_t(width) >> (24 - 8 * i));
+            header[8 + i] = static_cast<unsigned char>(uint32_t(height) >> (24 - 8 * i));
+        }
+        header[12] = 3;     // RGB
+        header[13] = 0;     // sRGB with linear alpha
+        file_.write(header, sizeof(header));
+        memset(seen_, 0, sizeof(seen_));
+    }
+
+    void write_rows(const unsigned char *rows, int count) override {
+        out_.clear();
+        const size_t pixels = size_t(width_) * count;
+        for (size_t i = 0; i < pixels; ++i) {
+            const unsigned char *px = rows + 3 * i;
+            if (px[0] == prev_[0] && px[1] == prev_[1] && px[2] == prev_[2]) {
+                if (++run_ == 62)
+                    flush_run();
+                continue;
+            }
+            flush_run();
+            const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+            if (seen_[slot][0] == px[0] && seen_[slot][1] == px[1] && seen_[slot][2] == px[2] && seen_[slot][3] == 255) {
+                out_.push_back(static_cast<unsigned char>(slot));
+            } else {
+                seen_[slot][0] = px[0];
+                seen_[slot][1] = px[1];
+                seen_[slot][2] = px[2];
+                seen_[slot][3] = 255;
+                const int dr = int8_t(px[0] - prev_[0]), dg = int8_t(px[1] - prev_[1]), db = int8_t(px[2] - prev_[2]);
+                const int dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out_.push_back(static_cast<unsigned char>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out_.push_back(static_cast<unsigned char>(0x80 | (dg + 32)));
+                    out_.push_back(static_cast<unsigned char>((dr_dg + 8) << 4 | (db_dg + 8)));
+                } else {
+                    const unsigned char rgb[4] = { 0xfe, px[0], px[1], px[2] };
+                    out_.insert(out_.end(), rgb, rgb + 4);
+                }
+            }
+            prev_[0] = px[0];
+            prev_[1] = px[1];
+            prev_[2] = px[2];
+        }
+        file_.write(out_.data(), out_.size());
+    }
+
+    void finish() override {
+        out_.clear();
+        flush_run();
+        const unsigned char end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+        out_.insert(out_.end(), end_marker, end_marker + 8);
+        file_.write(out_.data(), out_.size());
+        file_.close();
+    }
+
+private:
+    stream_file file_;
+    int width_;
+    std::vector<unsigned char> out_;
+    unsigned char seen_[64][4];
+    unsigned char prev_[3] = { 0, 0, 0 };     // the format starts from opaque black
+    int run_ = 0;
+
+    void flush_run() {
+        if (run_ > 0)
+            out_.push_back(static_cast<unsigned char>(0xc0 | (run_ - 1)));
+        run_ = 0;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Everything else goes through stb_image_write, which needs the whole image.
+
+class buffered_writer : public image_writer {
+public:
+    buffered_writer(const std::string &path, const std::string &ext, int width, int height)
+        : path_(path), ext_(ext), width_(width), height_(height) {
+        image_.reserve(size_t(width) * height * 3);
+    }
+    void write_rows(const unsigned char *rows, int count) override {
+        image_.insert(image_.end(), rows, rows + size_t(width_) * 3 * count);
+    }
+    void finish() override {
+        int ok = 0;
+        if (ext_ == "bmp")
+            ok = stbi_write_bmp(path_.c_str(), width_, height_, 3, image_.data());
+        else if (ext_ == "tga")
+            ok = stbi_write_tga(path_.c_str(), width_, height_, 3, image_.data());
+        else
+            ok = stbi_write_jpg(path_.c_str(), width_, height_, 3, image_.data(), 95);
+        if (!ok)
+            throw image_error(path_ + ": write failed");
+    }
+
+private:
+    std::string path_, ext_;
+    int width_, height_;
+    std::vector<unsigned char> image_;
+};
+
+} // namespace
+
+std::unique_ptr<image_writer> open_image_writer(const std::string &path, int width, int height, size_t threads) {
+    const std::string ext = lower_extension(path);
+    if (ext == "png")
+        return std::unique_ptr<image_writer>(new png_writer(path, width, height, threads));
+    if (ext == "ppm")
+        return std::unique_ptr<image_writer>(new ppm_writer(path, width, height));
+    if (ext == "pfm")
+        return std::unique_ptr<image_writer>(new pfm_writer(path, width, height));
+    if (ext == "qoi")
+        return std::unique_ptr<image_writer>(new qoi_writer(path, width, height));
+    if (ext == "bmp" || ext == "tga" || ext == "jpg" || ext == "jpeg")
+        return std::unique_ptr<image_writer>(new buffered_writer(path, ext, width, height));
+    throw image_error(path + ": unknown image format, use .png, .ppm, .qoi, .pfm, .bmp, .tga or .jpg");
+}
+
+bool is_float_format(const std::string &path) {
+    return lower_extension(path) == "pfm";
+}
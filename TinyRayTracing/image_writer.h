@@ -0,0 +1,74 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct image_error : std::runtime_error {
+    explicit image_error(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * Takes an 8-bit RGB image a band of rows at a time, top to bottom. PPM, QOI,
+ * PNG and PFM are written as the rows arrive, so a render only ever holds one
+ * band; the formats left to stb_image_write (BMP, TGA, JPEG) are buffered whole.
+ *
+ * PFM stores linear floats. It takes float rows as well, which the renderer
+ * hands it instead of tone mapped bytes; see tonemap.h.
+ */
+class image_writer {
+public:
+    virtual ~image_writer() {}
+    // count rows of width * 3 bytes each.
+    virtual void write_rows(const unsigned char *rows, int count) = 0;
+    // Completes the file once all rows are written.
+    virtual void finish() = 0;
+
+    // Whether write_float_rows() is preferred over write_rows().
+    virtual bool takes_float() const { return false; }
+    // count rows of width * 3 linear floats each. Only for writers that take floats.
+    virtual void write_float_rows(const float *rows, int count) {
+        (void)rows; (void)count;
+        throw image_error("this image format takes 8-bit rows only");
+    }
+};
+
+// Collects the rows in memory, e.g. to encode them elsewhere later.
+class memory_writer : public image_writer {
+public:
+    // floats: take float rows, into linear, instead of bytes, for output to a float format.
+    explicit memory_writer(int width, bool floats = false) : row_values_(size_t(width) * 3), floats_(floats) {}
+
+    std::vector<unsigned char> pixels;
+    std::vector<float> linear;
+
+    void write_rows(const unsigned char *rows, int count) override {
+        pixels.insert(pixels.end(), rows, rows + row_values_ * count);
+    }
+    void finish() override {}
+
+    bool takes_float() const override { return floats_; }
+    void write_float_rows(const float *rows, int count) override {
+        linear.insert(linear.end(), rows, rows + row_values_ * count);
+    }
+
+private:
+    size_t row_values_;
+    bool floats_;
+};
+
+// Whether path names a format that stores floats, by its extension.
+bool is_float_format(const std::string &path);
+
+/**
+ * Picks the format from the file extension: .png, .ppm, .qoi, .pfm, .bmp,
+ * .tga or .jpg. PNG compresses every band in
+ * strips on `threads` threads (0: one per hardware thread); the other formats
+ * are cheap enough to write on the calling thread. Throws image_error.
+ */
+std::unique_ptr<image_writer> open_image_writer(const std::string &path, int width, int height, size_t threads = 1);
+
+#endif
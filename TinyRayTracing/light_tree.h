@@ -0,0 +1,113 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+/**
+ * Nodes are stored depth first like bvh_node: the left child of an interior
+ * node is the next node in the array, offset points to the right child.
+ * Every leaf holds exactly one light.
+ */
+struct light_node {
+    aabb     bounds;        // of the light positions below
+    float    intensity;     // summed over the lights below
+    uint32_t offset;        // leaf: light index, interior: index of the right child
+    bool     leaf;
+};
+
+/**
+ * Binary hierarchy over point lights for many-light sampling. sample()
+ * walks it from the root, at every node picking a child with probability
+ * proportional to an estimate of how much light it sends to the shading
+ * point (intensity over squared distance), so lights that matter get most
+ * of a small per-point budget of shadow rays. Dividing by the returned pdf
+ * keeps the estimate unbiased: every light with intensity has a nonzero
+ * chance at every point.
+ */
+class light_tree {
+public:
+    std::vector<light_node> nodes;
+
+    bool empty() const { return nodes.empty(); }
+
+    // positions[i] and intensities[i] describe light i.
+    void build(const std::vector<vec3> &positions, const std::vector<float> &intensities) {
+        nodes.clear();
+        if (positions.empty())
+            return;
+        std::vector<uint32_t> order(positions.size());
+        for (uint32_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        nodes.reserve(2 * positions.size());
+        build_node(positions, intensities, order, 0, uint32_t(order.size()));
+    }
+
+    /**
+     * Picks a light for a shading point at p and returns its index; pdf is
+     * the probability it was picked with. next() returns uniform numbers in
+     * [0, 1), one per level.
+     */
+    template <class Random>
+    uint32_t sample(const vec3 &p, Random &&next, float &pdf) const {
+        uint32_t n = 0;
+        pdf = 1;
+        while (!nodes[n].leaf) {
+            const uint32_t left = n + 1, right = nodes[n].offset;
+            const float wl = importance(nodes[left], p), wr = importance(nodes[right], p);
+            const float pl = wl + wr > 0 ? wl / (wl + wr) : 0.5f;
+            if (next() < pl) {
+                pdf *= pl;
+                n = left;
+            } else {
+                pdf *= 1 - pl;
+                n = right;
+            }
+        }
+        return nodes[n].offset;
+    }
+
+private:
+    // Intensity over the squared distance to the node's center, which is not allowed to come closer than its half diagonal.
+    static float importance(const light_node &node, const vec3 &p) {
+        const vec3 half = (node.bounds.max - node.bounds.min) * 0.5f;
+        const vec3 to_center = node.bounds.centroid() - p;
+        const float d2 = std::max(to_center * to_center, std::max(half * half, 1e-6f));
+        return node.intensity / d2;
+    }
+
+    uint32_t build_node(const std::vector<vec3> &positions, const std::vector<float> &intensities, std::vector<uint32_t> &order,
+                        uint32_t first, uint32_t count) {
+        const uint32_t index = uint32_t(nodes.size());
+        nodes.push_back(light_node());
+        aabb bounds;
+        float intensity = 0;
+        for (uint32_t i = first; i < first + count; ++i) {
+            bounds.expand(positions[order[i]]);
+            intensity += intensities[order[i]];
+        }
+        nodes[index].bounds = bounds;
+        nodes[index].intensity = intensity;
+        if (count == 1) {
+            nodes[index].leaf = true;
+            nodes[index].offset = order[first];
+            return index;
+        }
+
+        // Median split along the widest axis keeps the tree balanced, log2(lights) levels deep.
+        const vec3 extent = bounds.max - bounds.min;
+        const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        const uint32_t mid = first + count / 2;
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count,
+                         [&](uint32_t a, uint32_t b) { return positions[a][axis] < positions[b][axis]; });
+        nodes[index].leaf = false;
+        build_node(positions, intensities, order, first, mid - first);
+        nodes[index].offset = build_node(positions, intensities, order, mid, first + count - mid);
+        return index;
+    }
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "scene.h"
+
+/**
+ * Packet tracing of coherent primary rays: 4 rays (2x2 pixels) per SSE
+ * instruction or 8 rays (4x2 pixels) per AVX2 instruction, with rays in
+ * SoA form and spheres and triangles read from scene::soa and scene::tris.
+ * Only the closest-hit search is vectorized, shading continues per ray.
+ */
+const int max_packet_width = 8;
+
+struct ray_packet {
+    float ox[max_packet_width], oy[max_packet_width], oz[max_packet_width];
+    float dx[max_packet_width], dy[max_packet_width], dz[max_packet_width];
+};
+
+struct packet_hits {
+    float   t[max_packet_width];       // closest hit distance, float max when nothing was hit
+    int32_t prim[max_packet_width];    // bvh::prims reference, -1 when nothing was hit
+    float   u[max_packet_width];       // barycentrics of triangle hits
+    float   v[max_packet_width];
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRT_HAVE_PACKETS 1
+#include <immintrin.h>
+
+namespace packet_sse {
+
+struct lanes {
+    typedef __m128  f;
+    typedef __m128i i;
+    static const int width = 4;
+    static const int all_lanes = 0xf;
+    static f load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, f v) { _mm_storeu_ps(p, v); }
+    static i iload(const int32_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static void istore(int32_t *p, i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+    static f set1(float x) { return _mm_set1_ps(x); }
+    static i iset1(int32_t x) { return _mm_set1_epi32(x); }
+    static f add(f a, f b) { return _mm_add_ps(a, b); }
+    static f sub(f a, f b) { return _mm_sub_ps(a, b); }
+    static f mul(f a, f b) { return _mm_mul_ps(a, b); }
+    static f div(f a, f b) { return _mm_div_ps(a, b); }
+    static f sqrt(f a) { return _mm_sqrt_ps(a); }
+    static f lt(f a, f b) { return _mm_cmplt_ps(a, b); }
+    static f gt(f a, f b) { return _mm_cmpgt_ps(a, b); }
+    static f ne(f a, f b) { return _mm_cmpneq_ps(a, b); }
+    static f and_(f a, f b) { return _mm_and_ps(a, b); }
+    static f or_(f a, f b) { return _mm_or_ps(a, b); }
+    static f andnot(f mask, f b) { return _mm_andnot_ps(mask, b); }
+    static f select(f mask, f a, f b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static i iselect(f mask, i a, i b) {
+        const __m128i m = _mm_castps_si128(mask);
+        return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+    }
+    static int movemask(f mask) { return _mm_movemask_ps(mask); }
+};
+
+#include "packet_kernel.h"
+
+} // namespace packet_sse
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace packet_avx2 {
+
+struct lanes {
+    typedef __m256  f;
+    typedef __m256i i;
+    static const int width = 8;
+    static const int all_lanes = 0xff;
+    static f load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, f v) { _mm256_storeu_ps(p, v); }
+    static i iload(const int32_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static void istore(int32_t *p, i v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+    static f set1(float x) { return _mm256_set1_ps(x); }
+    static i iset1(int32_t x) { return _mm256_set1_epi32(x); }
+    static f add(f a, f b) { return _mm256_add_ps(a, b); }
+    static f sub(f a, f b) { return _mm256_sub_ps(a, b); }
+    static f mul(f a, f b) { return _mm256_mul_ps(a, b); }
+    static f div(f a, f b) { return _mm256_div_ps(a, b); }
+    static f sqrt(f a) { return _mm256_sqrt_ps(a); }
+    static f lt(f a, f b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static f gt(f a, f b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static f ne(f a, f b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static f and_(f a, f b) { return _mm256_and_ps(a, b); }
+    static f or_(f a, f b) { return _mm256_or_ps(a, b); }
+    static f andnot(f mask, f b) { return _mm256_andnot_ps(mask, b); }
+    static f select(f mask, f a, f b) { return _mm256_blendv_ps(b, a, mask); }
+    static i iselect(f mask, i a, i b) { return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), mask)); }
+    static int movemask(f mask) { return _mm256_movemask_ps(mask); }
+};
+
+#include "packet_kernel.h"
+
+} // namespace packet_avx2
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif // x86
+
+// Scalar fallback, one ray per "packet" through the regular BVH traversal.
+inline void intersect_packet_scalar(const scene &sc, const ray_packet &rays, packet_hits &hits, ray_counters *counters) {
+    const vec3 orig(rays.ox[0], rays.oy[0], rays.oz[0]);
+    const vec3 dir(rays.dx[0], rays.dy[0], rays.dz[0]);
+    hits.prim[0] = closest_prim(sc, orig, dir, hits.t[0], hits.u[0], hits.v[0], counters);
+}
+
+struct packet_tracer {
+    const char *name;
+    int width;          // rays per packet
+    int block_w;        // pixel block covered by one packet
+    int block_h;
+    // counters may be null; otherwise box and primitive tests are added, one per lane
+    void (*intersect)(const scene &sc, const ray_packet &rays, packet_hits &hits, ray_counters *counters);
+};
+
+/**
+ * Picks the widest packet kernel the CPU supports. request is "auto",
+ * "avx2", "sse" or "scalar"; asking for an unsupported set falls back.
+ */
+inline packet_tracer select_packet_tracer(const std::string &request = "auto") {
+    const packet_tracer scalar = { "scalar", 1, 1, 1, intersect_packet_scalar };
+#ifdef TRT_HAVE_PACKETS
+    __builtin_cpu_init();
+    const packet_tracer sse  = { "sse",  4, 2, 2, packet_sse::intersect_packet };
+    const packet_tracer avx2 = { "avx2", 8, 4, 2, packet_avx2::intersect_packet };
+    const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (request == "scalar")
+        return scalar;
+    if (request == "sse" || !has_avx2)
+        return sse;
+    return avx2;
+#else
+    (void)request;
+    return scalar;
+#endif
+}
+
+#endif
@@ -0,0 +1,222 @@
+// Packet traversal kernel, included by packet.h once per instruction set with
+// a different `lanes` type in scope. No include guard on purpose.
+
+// One triangle broadcast against all lanes; the lane-parallel form of intersect_triangle().
+inline void intersect_triangle_lanes(const triangle_soa &tris, uint32_t k, int kx, int ky, int kz,
+                                     lanes::f ox, lanes::f oy, lanes::f oz, lanes::f sx, lanes::f sy, lanes::f sz, lanes::i ref,
+                                     lanes::f &tmax, lanes::i &prim, lanes::f &hit_u, lanes::f &hit_v) {
+    typedef lanes::f f;
+    const f zero = lanes::set1(0.f);
+    const f az = lanes::sub(lanes::set1(tris.v[0][kz][k]), oz);
+    const f bz = lanes::sub(lanes::set1(tris.v[1][kz][k]), oz);
+    const f cz = lanes::sub(lanes::set1(tris.v[2][kz][k]), oz);
+    const f ax = lanes::sub(lanes::sub(lanes::set1(tris.v[0][kx][k]), ox), lanes::mul(sx, az));
+    const f ay = lanes::sub(lanes::sub(lanes::set1(tris.v[0][ky][k]), oy), lanes::mul(sy, az));
+    const f bx = lanes::sub(lanes::sub(lanes::set1(tris.v[1][kx][k]), ox), lanes::mul(sx, bz));
+    const f by = lanes::sub(lanes::sub(lanes::set1(tris.v[1][ky][k]), oy), lanes::mul(sy, bz));
+    const f cx = lanes::sub(lanes::sub(lanes::set1(tris.v[2][kx][k]), ox), lanes::mul(sx, cz));
+    const f cy = lanes::sub(lanes::sub(lanes::set1(tris.v[2][ky][k]), oy), lanes::mul(sy, cz));
+
+    const f U = lanes::sub(lanes::mul(cx, by), lanes::mul(cy, bx));
+    const f V = lanes::sub(lanes::mul(ax, cy), lanes::mul(ay, cx));
+    const f W = lanes::sub(lanes::mul(bx, ay), lanes::mul(by, ax));
+    const f negative = lanes::or_(lanes::or_(lanes::lt(U, zero), lanes::lt(V, zero)), lanes::lt(W, zero));
+    const f positive = lanes::or_(lanes::or_(lanes::gt(U, zero), lanes::gt(V, zero)), lanes::gt(W, zero));
+    const f det = lanes::add(lanes::add(U, V), W);
+
+    const f T = lanes::add(lanes::add(lanes::mul(U, lanes::mul(sz, az)), lanes::mul(V, lanes::mul(sz, bz))),
+                           lanes::mul(W, lanes::mul(sz, cz)));
+    const f rcp_det = lanes::div(lanes::set1(1.f), det);
+    const f dist = lanes::mul(T, rcp_det);
+
+    f ok = lanes::andnot(lanes::and_(negative, positive), lanes::ne(det, zero));
+    ok = lanes::and_(ok, lanes::and_(lanes::gt(dist, zero), lanes::lt(dist, tmax)));
+    if (lanes::movemask(ok) == 0)
+        return;
+    tmax  = lanes::select(ok, dist, tmax);
+    prim  = lanes::iselect(ok, ref, prim);
+    hit_u = lanes::select(ok, lanes::mul(V, rcp_det), hit_u);
+    hit_v = lanes::select(ok, lanes::mul(W, rcp_det), hit_v);
+}
+
+// Fallback for packets whose rays need different axis permutations: test the lanes one by one.
+inline void intersect_triangle_each(const triangle_soa &tris, uint32_t k, const watertight_ray *wr, lanes::i ref,
+                                    lanes::f &tmax, lanes::i &prim, lanes::f &hit_u, lanes::f &hit_v) {
+    float t[lanes::width], u[lanes::width], v[lanes::width];
+    int32_t p[lanes::width], r[lanes::width];
+    lanes::store(t, tmax);
+    lanes::store(u, hit_u);
+    lanes::store(v, hit_v);
+    lanes::istore(p, prim);
+    lanes::istore(r, ref);
+    for (int l = 0; l < lanes::width; ++l) {
+        if (intersect_triangle(tris, k, wr[l], t[l], t[l], u[l], v[l]))
+            p[l] = r[l];
+    }
+    tmax  = lanes::load(t);
+    hit_u = lanes::load(u);
+    hit_v = lanes::load(v);
+    prim  = lanes::iload(p);
+}
+
+// Planes, boxes and quadrics are rare next to spheres and triangles; they are tested lane by lane.
+inline void intersect_shape_each(const scene &sc, uint32_t ref, const ray_packet &rays, lanes::f &tmax, lanes::i &prim) {
+    float t[lanes::width];
+    int32_t p[lanes::width];
+    lanes::store(t, tmax);
+    lanes::istore(p, prim);
+    for (int l = 0; l < lanes::width; ++l) {
+        float d;
+        if (intersect_shape(sc, ref, vec3(rays.ox[l], rays.oy[l], rays.oz[l]), vec3(rays.dx[l], rays.dy[l], rays.dz[l]), d) && d < t[l]) {
+            t[l] = d;
+            p[l] = int32_t(ref);
+        }
+    }
+    tmax = lanes::load(t);
+    prim = lanes::iload(p);
+}
+
+/**
+ * Closest sphere, shape or triangle hit for lanes::width rays at once. Mirrors the
+ * scalar closest_prim() path operation for operation, so every lane gets
+ * bit-identical distances; a node is entered when any lane's ray enters it
+ * before that lane's current closest hit.
+ */
+inline void intersect_packet(const scene &sc, const ray_packet &rays, packet_hits &hits, ray_counters *counters) {
+    typedef lanes::f f;
+    typedef lanes::i i;
+
+    const f ox = lanes::load(rays.ox), oy = lanes::load(rays.oy), oz = lanes::load(rays.oz);
+    const f dx = lanes::load(rays.dx), dy = lanes::load(rays.dy), dz = lanes::load(rays.dz);
+    const f one = lanes::set1(1.f), zero = lanes::set1(0.f);
+    const f inv_dx = lanes::div(one, dx), inv_dy = lanes::div(one, dy), inv_dz = lanes::div(one, dz);
+    const f neg_x = lanes::lt(inv_dx, zero), neg_y = lanes::lt(inv_dy, zero), neg_z = lanes::lt(inv_dz, zero);
+
+    f tmax = lanes::set1(std::numeric_limits<float>::max());
+    i prim = lanes::iset1(-1);
+    f hit_u = zero, hit_v = zero;
+
+    const bvh &accel = sc.accel;
+    if (accel.empty()) {
+        lanes::store(hits.t, tmax);
+        lanes::istore(hits.prim, prim);
+        lanes::store(hits.u, hit_u);
+        lanes::store(hits.v, hit_v);
+        return;
+    }
+
+    // Watertight setup per lane. Triangles are tested lane-parallel only when
+    // all rays share the permuted axes, which primary rays virtually always do.
+    watertight_ray wr[lanes::width];
+    float wsx[lanes::width], wsy[lanes::width], wsz[lanes::width];
+    float wox[lanes::width], woy[lanes::width], woz[lanes::width];
+    bool same_axes = true;
+    for (int l = 0; l < lanes::width; ++l) {
+        wr[l] = watertight_ray(vec3(rays.ox[l], rays.oy[l], rays.oz[l]), vec3(rays.dx[l], rays.dy[l], rays.dz[l]));
+        wsx[l] = wr[l].sx; wsy[l] = wr[l].sy; wsz[l] = wr[l].sz;
+        wox[l] = wr[l].ox; woy[l] = wr[l].oy; woz[l] = wr[l].oz;
+        same_axes = same_axes && wr[l].kx == wr[0].kx && wr[l].ky == wr[0].ky && wr[l].kz == wr[0].kz;
+    }
+    const f sx = lanes::load(wsx), sy = lanes::load(wsy), sz = lanes::load(wsz);
+    const f tox = lanes::load(wox), toy = lanes::load(woy), toz = lanes::load(woz);
+    const int kx = wr[0].kx, ky = wr[0].ky, kz = wr[0].kz;
+    // Coherent packets share direction signs, so the first ray decides the child order.
+    const bool dir_neg[3] = { rays.dx[0] < 0, rays.dy[0] < 0, rays.dz[0] < 0 };
+
+    uint32_t stack[64];
+    int stack_size = 0;
+    uint32_t current = 0;
+    uint32_t boxes = 0, spheres = 0, shapes = 0, triangles = 0;
+    for (;; ++boxes) {
+        const bvh_node &node = accel.nodes[current];
+
+        // Same slab test as bvh::hit_box, including how NaNs fall through the comparisons.
+        f tnear = zero, tfar = tmax;
+        {
+            f t0 = lanes::mul(lanes::sub(lanes::set1(node.bounds.min.x), ox), inv_dx);
+            f t1 = lanes::mul(lanes::sub(lanes::set1(node.bounds.max.x), ox), inv_dx);
+            f lo = lanes::select(neg_x, t1, t0), hi = lanes::select(neg_x, t0, t1);
+            tnear = lanes::select(lanes::gt(lo, tnear), lo, tnear);
+            tfar  = lanes::select(lanes::lt(hi, tfar),  hi, tfar);
+        }
+        {
+            f t0 = lanes::mul(lanes::sub(lanes::set1(node.bounds.min.y), oy), inv_dy);
+            f t1 = lanes::mul(lanes::sub(lanes::set1(node.bounds.max.y), oy), inv_dy);
+            f lo = lanes::select(neg_y, t1, t0), hi = lanes::select(neg_y, t0, t1);
+            tnear = lanes::select(lanes::gt(lo, tnear), lo, tnear);
+            tfar  = lanes::select(lanes::lt(hi, tfar),  hi, tfar);
+        }
+        {
+            f t0 = lanes::mul(lanes::sub(lanes::set1(node.bounds.min.z), oz), inv_dz);
+            f t1 = lanes::mul(lanes::sub(lanes::set1(node.bounds.max.z), oz), inv_dz);
+            f lo = lanes::select(neg_z, t1, t0), hi = lanes::select(neg_z, t0, t1);
+            tnear = lanes::select(lanes::gt(lo, tnear), lo, tnear);
+            tfar  = lanes::select(lanes::lt(hi, tfar),  hi, tfar);
+        }
+        const bool any_hit = lanes::movemask(lanes::lt(tfar, tnear)) != lanes::all_lanes;
+
+        if (any_hit) {
+            if (node.is_leaf()) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k) {
+                    const uint32_t ref = accel.prims[k];
+                    if (ref & prim_triangle) {
+                        ++triangles;
+                        const uint32_t tri = ref & ~prim_triangle;
+                        if (same_axes)
+                            intersect_triangle_lanes(sc.tris, tri, kx, ky, kz, tox, toy, toz, sx, sy, sz, lanes::iset1(int32_t(ref)),
+                                                     tmax, prim, hit_u, hit_v);
+                        else
+                            intersect_triangle_each(sc.tris, tri, wr, lanes::iset1(int32_t(ref)), tmax, prim, hit_u, hit_v);
+                        continue;
+                    }
+                    if (ref & prim_shape) {
+                        ++shapes;
+                        intersect_shape_each(sc, ref, rays, tmax, prim);
+                        continue;
+                    }
+                    ++spheres;
+                    const f r2 = lanes::set1(sc.soa.r2[ref]);
+                    const f lx = lanes::sub(lanes::set1(sc.soa.cx[ref]), ox);
+                    const f ly = lanes::sub(lanes::set1(sc.soa.cy[ref]), oy);
+                    const f lz = lanes::sub(lanes::set1(sc.soa.cz[ref]), oz);
+                    const f tca = lanes::add(lanes::add(lanes::mul(lx, dx), lanes::mul(ly, dy)), lanes::mul(lz, dz));
+                    const f ll  = lanes::add(lanes::add(lanes::mul(lx, lx), lanes::mul(ly, ly)), lanes::mul(lz, lz));
+                    const f d2  = lanes::sub(ll, lanes::mul(tca, tca));
+                    const f thc = lanes::sqrt(lanes::sub(r2, d2));
+                    f t0 = lanes::sub(tca, thc);
+                    const f t1 = lanes::add(tca, thc);
+                    t0 = lanes::select(lanes::lt(t0, zero), t1, t0);
+
+                    f ok = lanes::andnot(lanes::gt(d2, r2), lanes::lt(t0, tmax));
+                    ok = lanes::andnot(lanes::lt(t0, zero), ok);
+                    if (lanes::movemask(ok) == 0)
+                        continue;
+                    tmax = lanes::select(ok, t0, tmax);
+                    prim = lanes::iselect(ok, lanes::iset1(int32_t(ref)), prim);
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+    if (counters) {
+        counters->box_tests += uint64_t(boxes + 1) * lanes::width;
+        counters->sphere_tests += uint64_t(spheres) * lanes::width;
+        counters->shape_tests += uint64_t(shapes) * lanes::width;
+        counters->triangle_tests += uint64_t(triangles) * lanes::width;
+    }
+
+    lanes::store(hits.t, tmax);
+    lanes::istore(hits.prim, prim);
+    lanes::store(hits.u, hit_u);
+    lanes::store(hits.v, hit_v);
+}
@@ -0,0 +1,42 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+/**
+ * Counter-based random numbers. The n-th number of a stream is a hash of the
+ * stream's key and n; nothing carries over from one call to the next, so a
+ * stream can be recreated anywhere from its key alone. Keyed by pixel, sample
+ * and the ray's place in the ray tree, the numbers a ray draws do not depend
+ * on which thread traces it, in which tile order or whether rays are traced
+ * depth first or bounce by bounce.
+ */
+
+// Finalizer with good avalanche for its cost: two multiplies (Wellons' lowbias32).
+inline uint32_t hash32(uint32_t h) {
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Key of all streams of sample `sample` of pixel (x, y).
+inline uint32_t pixel_key(int x, int y, uint32_t sample) {
+    return hash32(hash32(hash32(uint32_t(x) * 0x9E3779B1u) ^ uint32_t(y) * 0x85EBCA77u) ^ sample * 0xC2B2AE3Du);
+}
+
+struct random_stream {
+    uint32_t key = 0;
+    uint32_t counter = 0;
+
+    random_stream() = default;
+    random_stream(uint32_t pixel, uint32_t path) : key(hash32(pixel ^ hash32(path))) {}
+
+    // Uniform in [0, 1), 24 bits.
+    float next() {
+        const uint32_t h = hash32(key + counter++ * 0x9E3779B9u);
+        return (h >> 8) * (1.f / 16777216.f);
+    }
+};
+
+#endif
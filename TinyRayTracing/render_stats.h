@@ -0,0 +1,66 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Ray and intersection test counts. Every render thread fills its own copy
+ * without locking; they are summed with += once the render is done. Packet
+ * tests count one test per lane.
+ */
+struct ray_counters {
+    uint64_t primary = 0, reflection = 0, refraction = 0, shadow = 0;
+    uint64_t box_tests = 0, sphere_tests = 0, triangle_tests = 0, plane_tests = 0, shape_tests = 0;    // shape: bounded planes, boxes, quadrics
+
+    uint64_t rays() const { return primary + reflection + refraction + shadow; }
+
+    ray_counters &operator+=(const ray_counters &o) {
+        primary += o.primary; reflection += o.reflection; refraction += o.refraction; shadow += o.shadow;
+        box_tests += o.box_tests; sphere_tests += o.sphere_tests;
+        triangle_tests += o.triangle_tests; plane_tests += o.plane_tests; shape_tests += o.shape_tests;
+        return *this;
+    }
+};
+
+// Where render time goes. Shading is what is left of tracing after generation and traversal.
+enum render_stage {
+    stage_generate,     // sample positions and primary ray directions
+    stage_primary,      // packet traversal of primary rays
+    stage_secondary,    // closest hit of reflection and refraction rays
+    stage_shadow,       // any-hit shadow rays
+    stage_trace,        // whole tiles, the stages above included
+    stage_denoise,      // edge-aware filter over the finished image, see denoise.h
+    stage_encode,       // image writer
+    stage_count
+};
+
+const char *const render_stage_names[stage_count] = {
+    "generation", "primary traversal", "secondary traversal", "shadow traversal", "tracing", "denoise", "encode"
+};
+
+/**
+ * Adds the time until it goes out of scope to *seconds. A null pointer turns
+ * it off, which is how profiling stays free when not asked for.
+ */
+class stage_timer {
+public:
+    explicit stage_timer(double *seconds) : seconds_(seconds) {
+        if (seconds_)
+            start_ = std::chrono::steady_clock::now();
+    }
+    ~stage_timer() { stop(); }
+
+    // Ends the measurement early; later calls and the destructor add nothing.
+    void stop() {
+        if (seconds_)
+            *seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        seconds_ = nullptr;
+    }
+
+private:
+    double *seconds_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
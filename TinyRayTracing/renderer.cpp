@@ -0,0 +1,1425 @@
+#include "renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "denoise.h"
+#include "fast_math.h"
+#include "packet.h"
+#include "random.h"
+#include "thread_pool.h"
+
+namespace {
+
+const vec3 background_color(0.2, 0.7, 0.8);
+
+// Values of trace_context::last_occluder that are not bvh::prims references. Unbounded planes
+// are encoded as occluder_plane0 - plane index.
+const int occluder_none   = -1;
+const int occluder_plane0 = -2;
+
+enum ray_kind { ray_primary, ray_reflection, ray_refraction };
+
+/**
+ * Ray cone for texture filtering: a ray's footprint is width across at its
+ * origin and grows by spread per unit of distance. Primary rays start with
+ * no width and the angle of one pixel; reflected and refracted rays keep
+ * that angle, ignoring the curvature of what they bounced off.
+ */
+struct ray_cone {
+    float width;
+    float spread;
+};
+
+// A ray waiting on the explicit stack, with the weight its color contributes to the pixel.
+struct ray_task {
+    vec3     orig, dir;
+    float    weight;
+    int      depth;
+    ray_kind kind;
+    float    cone_width;        // at orig
+    uint32_t path;              // place in the ray tree: 1 for the primary ray, 2p and 2p + 1 for the reflection and refraction of path p
+};
+
+/**
+ * A secondary ray in wavefront mode with the color it contributes and the
+ * rays it spawned, -1 for none, in the order shade() pushed them, and the
+ * pixel_key() of the sample it belongs to.
+ */
+struct wave_ray {
+    ray_task ray;
+    vec3     color;
+    int32_t  child[2];
+    uint32_t pixel;
+};
+
+// Where a wave_ray hit, between tracing and shading.
+struct wave_hit {
+    vec3     point, N;
+    material mate;
+    float    cone_width;
+};
+
+// Sample `sample` of pixel (px, py), traced through image position (sx, sy).
+struct sample_job {
+    int      px, py;
+    uint32_t sample;
+    float    sx, sy;
+};
+
+// What the denoiser is guided by, taken from a job's primary hit.
+struct sample_guide {
+    vec3  normal;       // 0 on a miss
+    float depth;        // denoise_buffers::miss_depth on a miss
+    vec3  albedo;
+};
+
+// Per-thread tracing state. Each pool thread owns one, so nothing in here needs locking.
+struct trace_context {
+    trace_settings settings;
+
+    // Last primitive that blocked each light. Neighbouring shading points tend to be
+    // shadowed by the same object, so it is tested first by the next shadow ray.
+    std::vector<int> last_occluder;
+
+    std::vector<ray_task> ray_stack;
+
+    uint32_t pixel = 0;         // pixel_key() of the sample being traced
+    uint32_t path = 1;          // ray_task::path of the ray being shaded
+    random_stream rng;          // that ray's random numbers
+
+    float cone_spread = 0;      // ray_cone::spread of the current image, set by trace_samples()
+
+    // Profiling: counters are always kept, stage times only when profile is set.
+    ray_counters counters;
+    bool   profile = false;
+    double stage_seconds[stage_count] = {};
+
+    trace_context(const scene &sc, const trace_settings &s) : settings(s), last_occluder(sc.lights.size(), occluder_none) {
+        ray_stack.reserve(64);
+    }
+
+    double *stage(render_stage s) { return profile ? &stage_seconds[s] : nullptr; }
+
+    // Scratch space of trace_samples().
+    std::vector<sample_job> jobs;
+    std::vector<vec3> colors;
+    bool guides = false;                        // also fill job_guides
+    std::vector<sample_guide> job_guides;
+
+    // Scratch space of wavefront mode, see trace_wavefront().
+    std::vector<wave_ray> wave;                 // all secondary rays of the jobs, bounce after bounce
+    std::vector<int32_t> job_children;          // wave_ray::child of each job's primary ray
+    std::vector<std::pair<uint64_t, uint32_t>> order;     // sort key, index into wave
+    std::vector<wave_hit> wave_hits;
+    std::vector<uint32_t> by_shader;
+    std::vector<int32_t> sum_stack;
+
+    void begin_pixel(int x, int y, uint32_t sample = 0) { pixel = pixel_key(x, y, sample); }
+
+    // Called before shading a ray: its random numbers depend only on the pixel sample and where the ray is in the ray tree.
+    void begin_ray(uint32_t ray_path) {
+        path = ray_path;
+        rng = random_stream(pixel, ray_path);
+    }
+
+    float next_random() { return rng.next(); }
+};
+
+// What a ray that hits nothing sees, the environment map filtered over the ray's cone angle if there is one.
+vec3 background(const scene &sc, const vec3 &dir, float spread) {
+    if (sc.environment < 0)
+        return background_color;
+    float u, v;
+    latlong_coords(dir, u, v);
+    return sc.textures[uint32_t(sc.environment)].sample(u, v, spread * float(1 / M_PI), true) * sc.environment_intensity;
+}
+
+/**
+ * Multiplies the diffuse color of m by its texture at hit, filtered over a
+ * ray cone of the given width there. Spheres are mapped by latitude and
+ * longitude, planes repeat the texture every texture_scale units. On planes
+ * the checker pattern, if m has one, picks the diffuse color first.
+ */
+void apply_texture(const scene &sc, const vec3 &dir, const vec3 &hit, const vec3 &N, const sphere *s, const plane *pl,
+                   float width, material &m) {
+    float u, v, per_unit;       // per_unit: texture coordinates per world unit
+    bool clamp_v = false;
+    if (s) {
+        latlong_coords((hit - s->center) * (1.f / s->radius), u, v);
+        per_unit = float(1 / M_PI) / s->radius;
+        clamp_v = true;
+    } else {
+        const vec3 t = cross(pl->normal, fabs(pl->normal.y) < 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0)).normalized();
+        const vec3 b = cross(pl->normal, t);
+        if (m.checker_size > 0) {
+            const float inv = 1.f / m.checker_size;
+            if ((int(std::floor((hit * t) * inv)) + int(std::floor((hit * b) * inv))) & 1)
+                m.diffuse_color = m.checker_color;
+            if (m.texture < 0)
+                return;
+        }
+        per_unit = 1.f / m.texture_scale;
+        u = (hit * t) * per_unit;
+        v = (hit * b) * per_unit;
+    }
+    // The footprint stretches as the surface turns away from the ray.
+    const float footprint = width * per_unit / std::max(float(fabs(dir * N)), 1e-3f);
+    const vec3 texel = sc.textures[uint32_t(m.texture)].sample(u, v, footprint, clamp_v);
+    m.diffuse_color = vec3(m.diffuse_color.x * texel.x, m.diffuse_color.y * texel.y, m.diffuse_color.z * texel.z);
+}
+
+/**
+ * Turns the closest BVH hit into hit point, normal and material, then lets
+ * closer unbounded planes override it. cone is the ray's at orig on entry
+ * and at the hit on return.
+ */
+bool resolve_hit(const vec3 &orig, const vec3 &dir, const scene &sc, int prim, float prim_dist, float u, float v,
+                 vec3 &hit, vec3 &N, material &material, ray_cone &cone, ray_counters &counters, uint32_t *hit_material = nullptr) {
+    const uint32_t no_material = ~0u;
+    uint32_t material_id = no_material;
+    const sphere *hit_sphere = nullptr;
+    const plane *hit_plane = nullptr;
+    if (prim >= 0) {
+        hit = orig + dir*prim_dist;
+        if (prim & prim_triangle) {
+            const uint32_t tri = prim & ~prim_triangle;
+            const mesh &m = sc.meshes[sc.tris.mesh[tri]];
+            N = m.shading_normal(sc.tris.tri[tri], u, v);
+            material_id = m.material_id;
+        } else if (prim & prim_shape) {
+            const uint32_t i = prim & shape_index_mask;
+            switch (prim_shape_kind(uint32_t(prim))) {
+            case shape_plane:
+                hit_plane = &sc.planes[i];
+                N = hit_plane->normal * dir < 0 ? hit_plane->normal : -hit_plane->normal;
+                material_id = hit_plane->material_id;
+                break;
+            case shape_box:
+                N = sc.boxes[i].normal(hit);
+                material_id = sc.boxes[i].material_id;
+                break;
+            default:
+                N = sc.quadrics[i].normal(hit);
+                material_id = sc.quadrics[i].material_id;
+                break;
+            }
+        } else {
+            const sphere &s = sc.spheres[sc.soa.index[prim]];
+            N = (hit - s.center).normalized();
+            material_id = s.material_id;
+            hit_sphere = &s;
+        }
+    }
+
+    float d;
+    for (const plane &pl : sc.planes) {
+        if (pl.bounded())
+            continue;
+        counters.plane_tests++;
+        if (pl.ray_intersect(orig, dir, d) && d < prim_dist) {
+            prim_dist = d;
+            hit = orig + dir*d;
+            N = pl.normal * dir < 0 ? pl.normal : -pl.normal;
+            material_id = pl.material_id;
+            hit_sphere = nullptr;
+            hit_plane = &pl;
+        }
+    }
+    // Fetched once the closest surface is known.
+    if (material_id == no_material)
+        return false;
+    material = sc.materials[material_id];
+    if ((material.texture >= 0 && (hit_sphere || hit_plane)) || (material.checker_size > 0 && hit_plane))
+        apply_texture(sc, dir, hit, N, hit_sphere, hit_plane, cone.width + cone.spread * prim_dist, material);
+    cone.width += cone.spread * prim_dist;
+    if (hit_material)
+        *hit_material = material_id;
+
+    return prim_dist < 1000;
+}
+
+bool scene_intersect(const vec3 &orig, const vec3 &dir, const scene &sc, vec3 &hit, vec3 &N, material &material, ray_cone &cone,
+                     ray_counters &counters) {
+    float dist, u, v;
+    int prim = closest_prim(sc, orig, dir, dist, u, v, &counters);
+    return resolve_hit(orig, dir, sc, prim, dist, u, v, hit, N, material, cone, counters);
+}
+
+// Does the BVH primitive prim block the ray before max_dist?
+bool prim_occludes(const scene &sc, uint32_t prim, const vec3 &orig, const vec3 &dir, float max_dist, ray_counters &counters) {
+    float d, u, v;
+    if (prim & prim_triangle) {
+        counters.triangle_tests++;
+        return intersect_triangle(sc.tris, prim & ~prim_triangle, watertight_ray(orig, dir), max_dist, d, u, v);
+    }
+    if (prim & prim_shape) {
+        counters.shape_tests++;
+        return intersect_shape(sc, prim, orig, dir, d) && d < max_dist;
+    }
+    counters.sphere_tests++;
+    return intersect_sphere(sc.soa, prim, orig, dir, d) && d < max_dist;
+}
+
+/**
+ * Any-hit query for shadow rays: is anything closer than max_dist along the ray?
+ * Stops at the first blocker and never computes hit points, normals or materials.
+ * The light's last occluder is tried before the unbounded planes and the BVH.
+ */
+bool scene_occluded(const vec3 &orig, const vec3 &dir, float max_dist, const scene &sc, int &last_occluder, ray_counters &counters) {
+    float d;
+    if (last_occluder >= 0) {
+        if (prim_occludes(sc, uint32_t(last_occluder), orig, dir, max_dist, counters))
+            return true;
+    } else if (last_occluder <= occluder_plane0) {
+        counters.plane_tests++;
+        if (sc.planes[occluder_plane0 - last_occluder].ray_intersect(orig, dir, d) && d < max_dist)
+            return true;
+    }
+
+    for (size_t i = 0; i < sc.planes.size(); ++i) {
+        if (sc.planes[i].bounded())
+            continue;
+        counters.plane_tests++;
+        if (sc.planes[i].ray_intersect(orig, dir, d) && d < max_dist) {
+            last_occluder = occluder_plane0 - int(i);
+            return true;
+        }
+    }
+
+    int blocker = occluder_none;
+    float tmax = max_dist;
+    const watertight_ray wr(orig, dir);
+    counters.box_tests += sc.accel.traverse_leaves(orig, dir, tmax, [&](uint32_t first, uint32_t count, float &) {
+        uint32_t k = first;
+        for (; k < first + count && !(sc.accel.prims[k] & (prim_triangle | prim_shape)); ++k) {
+            const uint32_t s = sc.accel.prims[k];
+            float dist_i;
+            counters.sphere_tests++;
+            if (int(s) != last_occluder && intersect_sphere(sc.soa, s, orig, dir, dist_i) && dist_i < max_dist) {
+                blocker = int(s);
+                return true;
+            }
+        }
+        for (; k < first + count && (sc.accel.prims[k] & prim_shape); ++k) {
+            const uint32_t s = sc.accel.prims[k];
+            float dist_i;
+            counters.shape_tests++;
+            if (int(s) != last_occluder && intersect_shape(sc, s, orig, dir, dist_i) && dist_i < max_dist) {
+                blocker = int(s);
+                return true;
+            }
+        }
+        // Counts the whole run, the SIMD test looks at all of it anyway.
+        counters.triangle_tests += first + count - k;
+        float t = max_dist, u, v;
+        uint32_t hit;
+        if (k < first + count && intersect_triangles<true>(sc.tris, sc.accel.prims[k] & ~prim_triangle, first + count - k, wr, t, hit, u, v)) {
+            blocker = int(hit | prim_triangle);
+            return true;
+        }
+        return false;
+    });
+    if (blocker != occluder_none)
+        last_occluder = blocker;
+    return blocker != occluder_none;
+}
+
+// Queues a secondary ray unless its weight is negligible; Russian roulette may drop it or boost its weight.
+void push_ray(trace_context &ctx, const vec3 &orig, const vec3 &dir, float weight, int depth, ray_kind kind, float cone_width) {
+    const trace_settings &ts = ctx.settings;
+    if (weight <= ts.min_weight)
+        return;
+    if (ts.roulette && depth >= ts.roulette_depth && weight < ts.roulette_weight) {
+        const float survive = weight / ts.roulette_weight;
+        if (ctx.next_random() >= survive)
+            return;
+        weight = ts.roulette_weight;
+    }
+    // Paths wrap after 31 bounces, which at worst repeats a stream.
+    ctx.ray_stack.push_back(ray_task{orig, dir, weight, depth, kind, cone_width, ctx.path * 2 + (kind == ray_refraction)});
+}
+
+/**
+ * The terms of the shading formula, one bit each. A material's shader is
+ * the set of terms whose albedo weight is not zero: a plain diffuse surface
+ * is term_diffuse, Phong adds term_specular, a mirror term_reflection and
+ * glass term_refraction.
+ */
+enum shading_term : unsigned {
+    term_diffuse    = 1,    // albedo[0]
+    term_specular   = 2,    // albedo[1]
+    term_reflection = 4,    // albedo[2]
+    term_refraction = 8,    // albedo3
+    shader_count    = 16
+};
+
+unsigned shader_kind(const material &mate) {
+    return (mate.albedo[0] != 0 ? term_diffuse : 0u) | (mate.albedo[1] != 0 ? term_specular : 0u)
+         | (mate.albedo[2] != 0 ? term_reflection : 0u) | (mate.albedo3 != 0 ? term_refraction : 0u);
+}
+
+/**
+ * Direct light at a known hit, scaled by the weight of the ray that got here.
+ * Reflection and refraction rays are pushed onto ctx.ray_stack with their
+ * share of that weight instead of being traced recursively.
+ *
+ * Compiled once per set of Terms, the others folded away: a term left out
+ * would have added exactly zero, so every kernel returns what the full
+ * formula does, and one without diffuse and specular casts no shadow rays.
+ */
+template <class Math, unsigned Terms>
+vec3 shade_kernel(const vec3 &dir, const vec3 &point, const vec3 &N, const material &mate, const scene &sc, trace_context &ctx, float weight,
+                  int depth, float cone_width) {
+    if (Terms & term_reflection) {
+        vec3 reflect_dir   = normalize<Math>(reflect(dir, N));
+        vec3 reflect_orig  = reflect_dir * N < 0 ? point - N*1e-3 : point + N*1e-3;
+        push_ray(ctx, reflect_orig, reflect_dir, weight * mate.albedo[2], depth + 1, ray_reflection, cone_width);
+    }
+    vec3 total_internal;
+    if (Terms & term_refraction) {
+        vec3 refract_dir   = refract(dir, N, mate.refractive_index);
+        if (refract_dir * refract_dir > 0) {
+            refract_dir = normalize<Math>(refract_dir);
+            vec3 refract_orig  = refract_dir * N < 0 ? point - N*1e-3 : point + N*1e-3;
+            push_ray(ctx, refract_orig, refract_dir, weight * mate.albedo3, depth + 1, ray_refraction, cone_width);
+        } else {
+            // Total internal reflection leaves no direction. Tracing the NaN it normalizes to
+            // visits every BVH node and then misses, so take the miss color right away.
+            total_internal = background(sc, reflect(dir, N), ctx.cone_spread) * (weight * mate.albedo3);
+        }
+    }
+    if (!(Terms & (term_diffuse | term_specular)))
+        return total_internal;
+
+    float diffuse_light_intensity  = 0;
+    float specular_light_intensity = 0;
+    // Light i scaled by scale: 1 when every light is visited, one over the sample count and pdf when they are sampled.
+    auto add_light = [&](size_t i, float scale) {
+        const light &lt = sc.lights[i];
+        const vec3 to_light = lt.position - point;
+        const float light_distance2 = to_light * to_light;
+        vec3 light_dir = to_light * Math::rsqrt(light_distance2);
+        float light_distance = Math::sqrt(light_distance2);
+
+        vec3 shadow_orig = light_dir * N < 0 ? point - N*1e-3 : point + N*1e-3;
+        ctx.counters.shadow++;
+        bool occluded;
+        {
+            stage_timer timer(ctx.stage(stage_shadow));
+            occluded = scene_occluded(shadow_orig, light_dir, light_distance, sc, ctx.last_occluder[i], ctx.counters);
+        }
+        if (occluded)
+            return;
+
+        const float intensity = lt.intensity * scale;
+        if (Terms & term_diffuse)
+            diffuse_light_intensity  += intensity * std::max(light_dir * N, 0.f);
+        if (Terms & term_specular)
+            specular_light_intensity += Math::pow(std::max(-reflect(-light_dir, N) * dir, 0.f),  mate.specular_exponent) * intensity;
+    };
+    const int budget = ctx.settings.light_samples;
+    if (budget > 0 && size_t(budget) < sc.lights.size()) {
+        for (int k = 0; k < budget; ++k) {
+            float pdf;
+            const uint32_t i = sc.light_accel.sample(point, [&] { return ctx.next_random(); }, pdf);
+            add_light(i, 1 / (float(budget) * pdf));
+        }
+    } else {
+        for (size_t i = 0; i < sc.lights.size(); ++i)
+            add_light(i, 1);
+    }
+
+    if (!(Terms & term_specular))
+        return (mate.diffuse_color * diffuse_light_intensity * mate.albedo[0]) * weight + total_internal;
+    if (!(Terms & term_diffuse))
+        return (vec3(1., 1., 1.) * specular_light_intensity * mate.albedo[1]) * weight + total_internal;
+    return (mate.diffuse_color * diffuse_light_intensity * mate.albedo[0]
+            + vec3(1., 1., 1.) * specular_light_intensity * mate.albedo[1]) * weight + total_internal;
+}
+
+typedef vec3 (*shader)(const vec3 &dir, const vec3 &point, const vec3 &N, const material &mate, const scene &sc, trace_context &ctx,
+                       float weight, int depth, float cone_width);
+
+// The kernels, indexed by shader_kind().
+template <class Math>
+const shader *shader_table() {
+    static const shader table[shader_count] = {
+        shade_kernel<Math, 0>,  shade_kernel<Math, 1>,  shade_kernel<Math, 2>,  shade_kernel<Math, 3>,
+        shade_kernel<Math, 4>,  shade_kernel<Math, 5>,  shade_kernel<Math, 6>,  shade_kernel<Math, 7>,
+        shade_kernel<Math, 8>,  shade_kernel<Math, 9>,  shade_kernel<Math, 10>, shade_kernel<Math, 11>,
+        shade_kernel<Math, 12>, shade_kernel<Math, 13>, shade_kernel<Math, 14>, shade_kernel<Math, 15>,
+    };
+    return table;
+}
+
+vec3 shade(const vec3 &dir, const vec3 &point, const vec3 &N, const material &mate, const scene &sc, trace_context &ctx, float weight, int depth,
+           float cone_width) {
+    const shader *table = ctx.settings.fast_math ? shader_table<math_fast>() : shader_table<math_exact>();
+    return table[shader_kind(mate)](dir, point, N, mate, sc, ctx, weight, depth, cone_width);
+}
+
+// Traces everything on ctx.ray_stack and returns the summed weighted colors.
+vec3 trace_stack(const scene &sc, trace_context &ctx) {
+    vec3 color;
+    while (!ctx.ray_stack.empty()) {
+        const ray_task ray = ctx.ray_stack.back();
+        ctx.ray_stack.pop_back();
+
+        vec3 point, N;
+        material mate;
+        bool hit = false;
+        ray_cone cone = { ray.cone_width, ctx.cone_spread };
+        if (ray.depth <= ctx.settings.max_depth) {
+            ray_counters &c = ctx.counters;
+            (ray.kind == ray_reflection ? c.reflection : ray.kind == ray_refraction ? c.refraction : c.primary)++;
+            stage_timer timer(ctx.stage(stage_secondary));
+            hit = scene_intersect(ray.orig, ray.dir, sc, point, N, mate, cone, ctx.counters);
+        }
+        if (!hit) {
+            color = color + background(sc, ray.dir, ctx.cone_spread) * ray.weight;
+        } else {
+            ctx.begin_ray(ray.path);
+            color = color + shade(ray.dir, point, N, mate, sc, ctx, ray.weight, ray.depth, cone.width);
+        }
+    }
+    return color;
+}
+
+
+/**
+ * Offset of sample n inside its pixel, from the R2 low-discrepancy sequence.
+ * Sample 0 is the pixel center, so a single sample matches the old render.
+ */
+void sample_offset(uint32_t n, float &ox, float &oy) {
+    ox = float(fmod(0.5 + n * 0.7548776662466927, 1.0));
+    oy = float(fmod(0.5 + n * 0.5698402909980532, 1.0));
+}
+
+/**
+ * Appends the samples of the tile's pixels in packet block order, so that a
+ * packet covers a compact block of pixels. samples(px, py, first, count)
+ * says which samples a pixel wants.
+ */
+template <class SampleFn>
+void tile_jobs(int x0, int y0, int x1, int y1, const packet_tracer &tracer, SampleFn &&samples, std::vector<sample_job> &jobs) {
+    jobs.clear();
+    for (int by = y0; by < y1; by += tracer.block_h) {
+        for (int bx = x0; bx < x1; bx += tracer.block_w) {
+            for (int j = by; j < std::min(by + tracer.block_h, y1); ++j) {
+                for (int i = bx; i < std::min(bx + tracer.block_w, x1); ++i) {
+                    uint32_t first, count;
+                    samples(i, j, first, count);
+                    for (uint32_t n = first; n < first + count; ++n) {
+                        float ox, oy;
+                        sample_offset(n, ox, oy);
+                        jobs.push_back(sample_job{i, j, n, i + ox, j + oy});
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Moves the rays shade() just pushed onto ctx.ray_stack to the end of
+ * ctx.wave, for the next bounce, and notes their indices in child.
+ */
+void adopt_children(trace_context &ctx, int32_t *child) {
+    for (size_t i = 0; i < ctx.ray_stack.size(); ++i) {
+        child[i] = int32_t(ctx.wave.size());
+        ctx.wave.push_back(wave_ray{ctx.ray_stack[i], vec3(), {-1, -1}, ctx.pixel});
+    }
+    ctx.ray_stack.clear();
+}
+
+/**
+ * What the rays below child add up to, in the order trace_stack() would
+ * have added them: last pushed first, each ray's own children right after
+ * it. The same float additions in the same order give the same image.
+ */
+vec3 sum_children(trace_context &ctx, const int32_t *child) {
+    std::vector<int32_t> &stack = ctx.sum_stack;
+    stack.clear();
+    for (int i = 0; i < 2 && child[i] >= 0; ++i)
+        stack.push_back(child[i]);
+    vec3 sum;
+    while (!stack.empty()) {
+        const wave_ray &r = ctx.wave[size_t(stack.back())];
+        stack.pop_back();
+        sum = sum + r.color;
+        for (int i = 0; i < 2 && r.child[i] >= 0; ++i)
+            stack.push_back(r.child[i]);
+    }
+    return sum;
+}
+
+// Spreads the low 10 bits of x out to every third bit.
+uint32_t spread_bits3(uint32_t x) {
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8)  & 0x0300f00f;
+    x = (x | x << 4)  & 0x030c30c3;
+    x = (x | x << 2)  & 0x09249249;
+    return x;
+}
+
+/**
+ * Sort key that puts rays with similar directions and nearby origins next
+ * to each other: the direction octant, then the direction quantized on the
+ * octahedron to 4 bits per axis, then the Morton code of the origin's cell
+ * in a 1024^3 grid over the scene bounds.
+ */
+uint64_t ray_sort_key(const ray_task &r, const aabb &bounds) {
+    const vec3 &d = r.dir;
+    const uint64_t octant = uint64_t(d.x < 0) | uint64_t(d.y < 0) << 1 | uint64_t(d.z < 0) << 2;
+    const float l1 = std::fabs(d.x) + std::fabs(d.y) + std::fabs(d.z);
+    const uint64_t qx = l1 > 0 ? uint64_t(std::min(std::fabs(d.x) / l1 * 16.f, 15.f)) : 0;
+    const uint64_t qy = l1 > 0 ? uint64_t(std::min(std::fabs(d.y) / l1 * 16.f, 15.f)) : 0;
+    uint32_t cell[3];
+    for (int a = 0; a < 3; ++a) {
+        const float extent = bounds.max[a] - bounds.min[a];
+        const float t = extent > 0 ? (r.orig[a] - bounds.min[a]) / extent : 0.f;
+        cell[a] = uint32_t(std::max(0.f, std::min(t, 1.f)) * 1023.f);
+    }
+    const uint64_t morton = spread_bits3(cell[0]) | spread_bits3(cell[1]) << 1 | spread_bits3(cell[2]) << 2;
+    return octant << 38 | qx << 34 | qy << 30 | morton;
+}
+
+/**
+ * Wavefront mode: traces the secondary rays in ctx.wave one bounce at a
+ * time instead of depth first per pixel. Each bounce is sorted by
+ * ray_sort_key() and traced in packets through the same kernel as primary
+ * rays; the hits are then shaded grouped by material, and whatever rays
+ * shading spawns make up the next bounce.
+ */
+void trace_wavefront(const scene &sc, const packet_tracer &tracer, trace_context &ctx) {
+    const aabb bounds = sc.accel.empty() ? aabb() : sc.accel.nodes[0].bounds;
+    std::vector<std::pair<uint64_t, uint32_t>> &order = ctx.order;
+    for (size_t begin = 0; begin < ctx.wave.size();) {
+        const size_t end = ctx.wave.size();
+        order.clear();
+        for (size_t i = begin; i < end; ++i) {
+            const ray_task &r = ctx.wave[i].ray;
+            if (r.depth <= ctx.settings.max_depth)
+                order.push_back(std::make_pair(ray_sort_key(r, bounds), uint32_t(i)));
+            else
+                ctx.wave[i].color = background(sc, r.dir, ctx.cone_spread) * r.weight;
+        }
+        std::sort(order.begin(), order.end());
+
+        // Closest hits, in sorted order. The sort keys are reused for the shader kind and material of each hit.
+        std::vector<wave_hit> &hits = ctx.wave_hits;
+        hits.resize(order.size());
+        for (size_t first = 0; first < order.size(); first += tracer.width) {
+            const int count = int(std::min(order.size() - first, size_t(tracer.width)));
+            ray_packet rays;
+            for (int l = 0; l < tracer.width; ++l) {
+                const ray_task &r = ctx.wave[order[first + std::min(l, count - 1)].second].ray;
+                rays.ox[l] = r.orig.x; rays.oy[l] = r.orig.y; rays.oz[l] = r.orig.z;
+                rays.dx[l] = r.dir.x; rays.dy[l] = r.dir.y; rays.dz[l] = r.dir.z;
+            }
+            packet_hits packet;
+            {
+                stage_timer timer(ctx.stage(stage_secondary));
+                tracer.intersect(sc, rays, packet, &ctx.counters);
+                for (int l = 0; l < count; ++l) {
+                    wave_ray &w = ctx.wave[order[first + l].second];
+                    (w.ray.kind == ray_reflection ? ctx.counters.reflection : ctx.counters.refraction)++;
+                    wave_hit &h = hits[first + l];
+                    ray_cone cone = { w.ray.cone_width, ctx.cone_spread };
+                    uint32_t material_id;
+                    if (resolve_hit(w.ray.orig, w.ray.dir, sc, packet.prim[l], packet.t[l], packet.u[l], packet.v[l],
+                                    h.point, h.N, h.mate, cone, ctx.counters, &material_id)) {
+                        h.cone_width = cone.width;
+                        order[first + l].first = uint64_t(shader_kind(h.mate)) << 32 | material_id;
+                    } else {
+                        w.color = background(sc, w.ray.dir, ctx.cone_spread) * w.ray.weight;
+                        order[first + l].first = ~0ull;
+                    }
+                }
+            }
+        }
+
+        // Shading grouped by shader kind, and within a kind by material; misses sort last and are already done.
+        std::vector<uint32_t> &by_shader = ctx.by_shader;
+        by_shader.resize(order.size());
+        for (uint32_t k = 0; k < by_shader.size(); ++k)
+            by_shader[k] = k;
+        std::stable_sort(by_shader.begin(), by_shader.end(), [&](uint32_t a, uint32_t b) { return order[a].first < order[b].first; });
+        for (uint32_t k : by_shader) {
+            if (order[k].first == ~0ull)
+                break;
+            const uint32_t i = order[k].second;
+            const wave_hit &h = hits[k];
+            const ray_task r = ctx.wave[i].ray;
+            ctx.pixel = ctx.wave[i].pixel;
+            ctx.begin_ray(r.path);
+            const vec3 color = shade(r.dir, h.point, h.N, h.mate, sc, ctx, r.weight, r.depth, h.cone_width);
+            int32_t child[2] = { -1, -1 };
+            adopt_children(ctx, child);
+            wave_ray &w = ctx.wave[i];
+            w.color = color;
+            w.child[0] = child[0];
+            w.child[1] = child[1];
+        }
+        begin = end;
+    }
+}
+
+/**
+ * Traces ctx.jobs in packets of tracer.width primary rays and leaves each
+ * job's linear color in ctx.colors, and if ctx.guides is set its primary hit
+ * in ctx.job_guides.
+ * Lanes past the last job repeat it.
+ */
+void trace_samples(const scene &sc, const camera &cam, int width, int height, const packet_tracer &tracer, trace_context &ctx) {
+    const std::vector<sample_job> &jobs = ctx.jobs;
+    const bool wavefront = ctx.settings.wavefront;
+    ctx.colors.resize(jobs.size());
+    if (ctx.guides)
+        ctx.job_guides.resize(jobs.size());
+    ctx.cone_spread = 2 * std::tan(cam.fov / 2) / float(height);     // one pixel at the image center
+    if (wavefront) {
+        ctx.wave.clear();
+        ctx.job_children.assign(jobs.size() * 2, -1);
+    }
+    for (size_t first = 0; first < jobs.size(); first += tracer.width) {
+        const int count = int(std::min(jobs.size() - first, size_t(tracer.width)));
+        ray_packet rays;
+        {
+            stage_timer timer(ctx.stage(stage_generate));
+            for (int l = 0; l < tracer.width; ++l) {
+                const sample_job &job = jobs[first + std::min(l, count - 1)];
+                vec3 dir = cam.ray_dir(job.sx, job.sy, width, height);
+                rays.ox[l] = cam.position.x; rays.oy[l] = cam.position.y; rays.oz[l] = cam.position.z;
+                rays.dx[l] = dir.x; rays.dy[l] = dir.y; rays.dz[l] = dir.z;
+            }
+        }
+
+        packet_hits hits;
+        ctx.counters.primary += count;
+        {
+            stage_timer timer(ctx.stage(stage_primary));
+            tracer.intersect(sc, rays, hits, &ctx.counters);
+        }
+
+        for (int l = 0; l < count; ++l) {
+            const sample_job &job = jobs[first + l];
+            const vec3 orig(rays.ox[l], rays.oy[l], rays.oz[l]);
+            const vec3 dir(rays.dx[l], rays.dy[l], rays.dz[l]);
+            vec3 point, N;
+            material mate;
+            vec3 color;
+            ray_cone cone = { 0.f, ctx.cone_spread };
+            ctx.begin_pixel(job.px, job.py, job.sample);
+            ctx.begin_ray(1);
+            if (resolve_hit(orig, dir, sc, hits.prim[l], hits.t[l], hits.u[l], hits.v[l], point, N, mate, cone, ctx.counters)) {
+                if (ctx.guides)
+                    ctx.job_guides[first + l] = { N, (point - orig).norm(), mate.diffuse_color };
+                color = shade(dir, point, N, mate, sc, ctx, 1.f, 0, cone.width);
+                if (wavefront)
+                    adopt_children(ctx, &ctx.job_children[(first + l) * 2]);
+                else
+                    color = color + trace_stack(sc, ctx);
+            } else {
+                color = background(sc, dir, ctx.cone_spread);
+                if (ctx.guides)
+                    ctx.job_guides[first + l] = { vec3(), denoise_buffers::miss_depth, color };
+            }
+            ctx.colors[first + l] = color;
+        }
+    }
+
+    if (wavefront)
+        trace_wavefront(sc, tracer, ctx);
+    if (wavefront) {
+        for (size_t k = 0; k < jobs.size(); ++k)
+            ctx.colors[k] = ctx.colors[k] + sum_children(ctx, &ctx.job_children[k * 2]);
+    }
+}
+
+// Opens opts.output for a progressive preview; a failure is reported but does not stop the render.
+std::unique_ptr<image_writer> open_output(const render_options &opts) {
+    try {
+        return open_image_writer(opts.output, opts.width, opts.height, opts.threads);
+    } catch (const image_error &e) {
+        std::cerr << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+/**
+ * Wall time per tile plus what --stats and --heatmap need from the threads'
+ * trace contexts once a render is done.
+ */
+struct render_profile {
+    typedef std::chrono::steady_clock clock;
+    int tiles_x, tiles_y, tile_size;
+    std::vector<double> tile_seconds;   // summed over passes in progressive mode
+    double denoise_seconds = 0, encode_seconds = 0;
+    clock::time_point start = clock::now();
+
+    render_profile(int width, int height, int tile)
+        : tiles_x((width + tile - 1) / tile), tiles_y((height + tile - 1) / tile), tile_size(tile)
+        , tile_seconds(size_t(tiles_x) * tiles_y, 0.0) {}
+
+    double *denoise(const render_options &opts) { return opts.stats ? &denoise_seconds : nullptr; }
+    double *encode(const render_options &opts) { return opts.stats ? &encode_seconds : nullptr; }
+
+    // Sums up the threads, then prints the summary and writes the heatmap as requested.
+    render_result report(const render_options &opts, const std::vector<trace_context> &contexts) const {
+        render_result result;
+        result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+        for (const trace_context &ctx : contexts)
+            result.rays += ctx.counters;
+        if (opts.stats)
+            print(contexts, result.seconds);
+        if (!opts.heatmap.empty())
+            write_heatmap(opts);
+        return result;
+    }
+
+private:
+    void print(const std::vector<trace_context> &contexts, double wall) const {
+        ray_counters c;
+        double stage[stage_count] = {};
+        for (const trace_context &ctx : contexts) {
+            c += ctx.counters;
+            for (int s = 0; s < stage_count; ++s)
+                stage[s] += ctx.stage_seconds[s];
+        }
+        stage[stage_denoise] = denoise_seconds;
+        stage[stage_encode] = encode_seconds;
+        const double shading = stage[stage_trace] - stage[stage_generate] - stage[stage_primary]
+                             - stage[stage_secondary] - stage[stage_shadow];
+
+        std::cout << "rays:  " << c.primary << " primary, " << c.reflection << " reflection, " << c.refraction
+                  << " refraction, " << c.shadow << " shadow; " << c.rays() / wall * 1e-6 << " Mrays/s" << std::endl;
+        std::cout << "tests: " << c.box_tests << " box, " << c.sphere_tests << " sphere, " << c.triangle_tests
+                  << " triangle, " << c.shape_tests << " shape, " << c.plane_tests << " plane" << std::endl;
+        std::cout << "time:  " << wall << " s wall; thread seconds:";
+        for (int s = 0; s < stage_count; ++s) {
+            if (s == stage_trace)
+                std::cout << " shading " << shading << ",";
+            else
+                std::cout << " " << render_stage_names[s] << " " << stage[s] << (s + 1 < stage_count ? "," : "");
+        }
+        std::cout << std::endl;
+        std::cout << "traversal: primary " << c.primary / stage[stage_primary] * 1e-6 << ", secondary "
+                  << (c.reflection + c.refraction) / stage[stage_secondary] * 1e-6 << " Mrays per thread second" << std::endl;
+
+        double lo = std::numeric_limits<double>::max(), hi = 0, sum = 0;
+        for (double t : tile_seconds) {
+            lo = std::min(lo, t);
+            hi = std::max(hi, t);
+            sum += t;
+        }
+        std::cout << "tiles: " << tile_seconds.size() << " of " << tile_size << "x" << tile_size << ", min "
+                  << lo * 1e3 << " ms, mean " << sum / tile_seconds.size() * 1e3 << " ms, max " << hi * 1e3 << " ms" << std::endl;
+    }
+
+    // Tile times as colors from black (fastest) over red and yellow to white (slowest).
+    void write_heatmap(const render_options &opts) const {
+        double lo = std::numeric_limits<double>::max(), hi = 0;
+        for (double t : tile_seconds) {
+            lo = std::min(lo, t);
+            hi = std::max(hi, t);
+        }
+        const double range = hi > lo ? hi - lo : 1.0;
+        std::unique_ptr<image_writer> out = open_image_writer(opts.heatmap, opts.width, opts.height);
+        std::vector<unsigned char> row(size_t(opts.width) * 3);
+        for (int y = 0; y < opts.height; ++y) {
+            for (int x = 0; x < opts.width; ++x) {
+                const double t = (tile_seconds[size_t(y / tile_size) * tiles_x + x / tile_size] - lo) / range;
+                const float v = float(t) * 3;
+                row[3*x + 0] = static_cast<unsigned char>(255 * std::min(1.f, v));
+                row[3*x + 1] = static_cast<unsigned char>(255 * std::max(0.f, std::min(1.f, v - 1)));
+                row[3*x + 2] = static_cast<unsigned char>(255 * std::max(0.f, std::min(1.f, v - 2)));
+            }
+            out->write_rows(row.data(), 1);
+        }
+        out->finish();
+    }
+};
+
+// Filters buf with opts.denoiser and streams it to out in 32-row bands.
+void write_denoised(denoise_buffers &buf, const render_options &opts, thread_pool &pool, render_profile &profile, image_writer &out) {
+    {
+        stage_timer timer(profile.denoise(opts));
+        denoise(buf, opts.denoiser, pool);
+    }
+    stage_timer timer(profile.encode(opts));
+    const int band_rows = 32;
+    std::vector<float> band(size_t(buf.width) * band_rows * 3);
+    std::vector<unsigned char> bytes;
+    for (int y0 = 0; y0 < buf.height; y0 += band_rows) {
+        const int rows = std::min(band_rows, buf.height - y0);
+        for (size_t k = 0; k < size_t(buf.width) * rows; ++k) {
+            const vec3 c = buf.color(size_t(y0) * buf.width + k);
+            band[3*k + 0] = c.x;
+            band[3*k + 1] = c.y;
+            band[3*k + 2] = c.z;
+        }
+        write_linear_rows(out, band.data(), buf.width, rows, opts.tone, bytes);
+    }
+    out.finish();
+}
+
+/**
+ * Renders the image one band of tile rows at a time and hands every finished
+ * band to the image writer, so memory stays at one band whatever the size.
+ * The tiles of a band are spread over the thread pool. With opts.denoise the
+ * whole image is kept instead, to be filtered once it is done. Colors stay
+ * linear until the band is written, see write_linear_rows().
+ */
+render_result render_streaming(const scene &sc, const render_options &opts, image_writer &out) {
+    const int width  = opts.width;
+    const int height = opts.height;
+    const int channels = 3;
+    const int tile_size = 32;
+    const packet_tracer tracer = select_packet_tracer(opts.simd);
+
+    std::vector<float> band(size_t(width) * tile_size * channels, 0.f);
+    std::vector<unsigned char> bytes;
+    const bool cropped = opts.crop_x1 > 0;
+    std::unique_ptr<denoise_buffers> denoised(opts.denoise ? new denoise_buffers(width, height) : nullptr);
+
+    // Every pixel only depends on its own ray, so the image is identical whichever thread renders a tile.
+    render_profile profile(width, height, tile_size);
+    const int tiles_x = profile.tiles_x;
+    thread_pool pool(opts.threads);
+    trace_context prototype(sc, opts.settings);
+    prototype.profile = opts.stats;
+    prototype.guides = opts.denoise;
+    std::vector<trace_context> contexts(pool.size(), prototype);
+    for (int band_y = 0; band_y < height; band_y += tile_size) {
+        const int band_rows = std::min(tile_size, height - band_y);
+        if (cropped)
+            std::fill(band.begin(), band.end(), 0.f);
+        pool.parallel_for(tiles_x, [&](size_t tile, size_t thread) {
+            const render_profile::clock::time_point tile_start = render_profile::clock::now();
+            trace_context &ctx = contexts[thread];
+            const int x0 = int(tile) * tile_size;
+            {
+                stage_timer timer(ctx.stage(stage_trace));
+                {
+                    stage_timer gen_timer(ctx.stage(stage_generate));
+                    tile_jobs(x0, band_y, std::min(x0 + tile_size, width), band_y + band_rows, tracer,
+                              [&](int x, int y, uint32_t &first, uint32_t &count) { first = 0; count = opts.in_crop(x, y); }, ctx.jobs);
+                }
+                trace_samples(sc, opts.cam, width, height, tracer, ctx);
+            }
+
+            for (size_t k = 0; k < ctx.jobs.size() && denoised; ++k) {
+                const size_t p = size_t(ctx.jobs[k].py) * width + ctx.jobs[k].px;
+                const sample_guide &g = ctx.job_guides[k];
+                denoised->set_color(p, ctx.colors[k]);
+                denoised->set_guides(p, g.normal, g.depth, g.albedo);
+            }
+            for (size_t k = 0; k < ctx.jobs.size() && !denoised; ++k) {
+                const vec3 &color = ctx.colors[k];
+                size_t index = (size_t(ctx.jobs[k].px) + size_t(ctx.jobs[k].py - band_y) * width) * channels;
+                band[index + 0] = color.x;
+                band[index + 1] = color.y;
+                band[index + 2] = color.z;
+            }
+            profile.tile_seconds[size_t(band_y / tile_size) * tiles_x + tile] =
+                std::chrono::duration<double>(render_profile::clock::now() - tile_start).count();
+        });
+        if (denoised)
+            continue;
+        stage_timer timer(profile.encode(opts));
+        write_linear_rows(out, band.data(), width, band_rows, opts.tone, bytes);
+    }
+    if (denoised) {
+        write_denoised(*denoised, opts, pool, profile, out);
+    } else {
+        stage_timer timer(profile.encode(opts));
+        out.finish();
+    }
+    render_result result = profile.report(opts, contexts);
+    result.samples = size_t(width) * height;
+    return result;
+}
+
+/**
+ * Accumulated samples per pixel. Linear colors are summed in float; the
+ * luminance sums give each pixel's variance, hence the standard error of its
+ * mean. Those are taken on the tone mapped samples, so that convergence is
+ * judged by what the image shows rather than by unbounded radiance.
+ */
+struct sample_buffer {
+    int width, height;
+    std::vector<float>    sum;          // r, g, b per pixel
+    std::vector<float>    lum_sum, lum_sq_sum;
+    std::vector<uint32_t> count;
+    std::vector<uint8_t>  active;       // wants more samples in the next pass
+
+    sample_buffer(int w, int h)
+        : width(w), height(h), sum(size_t(w) * h * 3, 0.f), lum_sum(size_t(w) * h, 0.f)
+        , lum_sq_sum(size_t(w) * h, 0.f), count(size_t(w) * h, 0), active(size_t(w) * h, 1) {}
+
+    void add(size_t p, const vec3 &c, const tone_mapping &tone) {
+        sum[3*p] += c.x;
+        sum[3*p + 1] += c.y;
+        sum[3*p + 2] += c.z;
+        const vec3 shown = tone_map(c, tone);
+        const float l = (shown.x + shown.y + shown.z) * (1.f / 3);
+        lum_sum[p] += l;
+        lum_sq_sum[p] += l * l;
+        count[p]++;
+    }
+    vec3 mean(size_t p) const {
+        const float inv = count[p] ? 1.f / count[p] : 0.f;
+        return vec3(sum[3*p] * inv, sum[3*p + 1] * inv, sum[3*p + 2] * inv);
+    }
+    float mean_luminance(size_t p) const { return count[p] ? lum_sum[p] / count[p] : 0.f; }
+    float standard_error(size_t p) const {
+        const float n = float(count[p]);
+        if (n < 2)
+            return std::numeric_limits<float>::max();
+        const float var = std::max(0.f, (lum_sq_sum[p] - lum_sum[p] * lum_sum[p] / n) / (n - 1));
+        return std::sqrt(var / n);
+    }
+
+    // Streams the current means to out.
+    void write(image_writer &out, const tone_mapping &tone) const {
+        const int band_rows = 32;
+        std::vector<float> band(size_t(width) * band_rows * 3);
+        std::vector<unsigned char> bytes;
+        for (int y0 = 0; y0 < height; y0 += band_rows) {
+            const int rows = std::min(band_rows, height - y0);
+            for (size_t k = 0; k < size_t(width) * rows; ++k) {
+                const vec3 c = mean(size_t(y0) * width + k);
+                band[3*k + 0] = c.x;
+                band[3*k + 1] = c.y;
+                band[3*k + 2] = c.z;
+            }
+            write_linear_rows(out, band.data(), width, rows, tone, bytes);
+        }
+        out.finish();
+    }
+};
+
+/**
+ * Progressive adaptive supersampling into a float framebuffer. The first pass
+ * puts one sample in every pixel center; pixels whose luminance differs from a
+ * neighbour by more than opts.contrast are refined, each later pass doubling
+ * their sample count, until the standard error of a pixel's mean drops below
+ * opts.tolerance or it reaches opts.max_samples. Converged pixels get no more
+ * samples. Without a time limit the result is deterministic; with one,
+ * rendering stops when it runs out (but not before the first pass is done)
+ * and the image so far is written.
+ * Intermediate images overwrite the output every opts.preview_interval; with
+ * opts.denoise only the final one is filtered, guided by the pixel centers.
+ */
+render_result render_progressive(const scene &sc, const render_options &opts, image_writer &out) {
+    typedef std::chrono::steady_clock clock;
+    const int width  = opts.width;
+    const int height = opts.height;
+    const int tile_size = 32;
+    const uint32_t max_batch = 32;
+    const packet_tracer tracer = select_packet_tracer(opts.simd);
+    const clock::time_point start = clock::now();
+    const bool limited = opts.time_limit > 0;
+    const clock::time_point deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opts.time_limit));
+    clock::time_point next_preview = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opts.preview_interval));
+
+    sample_buffer fb(width, height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+            fb.active[size_t(y) * width + x] = opts.in_crop(x, y);
+    }
+    std::unique_ptr<denoise_buffers> denoised(opts.denoise ? new denoise_buffers(width, height) : nullptr);
+    render_profile profile(width, height, tile_size);
+    const int tiles_x = profile.tiles_x;
+    const int tiles_y = profile.tiles_y;
+    thread_pool pool(opts.threads);
+    trace_context prototype(sc, opts.settings);
+    prototype.profile = opts.stats;
+    prototype.guides = opts.denoise;
+    std::vector<trace_context> contexts(pool.size(), prototype);
+
+    size_t total_samples = 0;
+    int pass = 0;
+    for (;; ++pass) {
+        // Tiles own disjoint pixels, so the accumulation needs no locking.
+        pool.parallel_for(tiles_x * tiles_y, [&](size_t tile, size_t thread) {
+            if (limited && pass > 0 && clock::now() >= deadline)
+                return;     // the first pass always completes, so every pixel has a sample
+            const clock::time_point tile_start = clock::now();
+            trace_context &ctx = contexts[thread];
+            const int x0 = int(tile % tiles_x) * tile_size;
+            const int y0 = int(tile / tiles_x) * tile_size;
+            stage_timer timer(ctx.stage(stage_trace));
+            stage_timer gen_timer(ctx.stage(stage_generate));
+            tile_jobs(x0, y0, std::min(x0 + tile_size, width), std::min(y0 + tile_size, height), tracer,
+                      [&](int x, int y, uint32_t &first, uint32_t &count) {
+                          const size_t p = size_t(y) * width + x;
+                          first = fb.count[p];
+                          count = 0;
+                          if (fb.active[p]) {
+                              const uint32_t want = first == 0 ? 1 : first == 1 ? uint32_t(opts.min_samples) - 1 : std::min(first, max_batch);
+                              count = std::min(want, uint32_t(opts.max_samples) - first);
+                          }
+                      }, ctx.jobs);
+            gen_timer.stop();
+            trace_samples(sc, opts.cam, width, height, tracer, ctx);
+            for (size_t k = 0; k < ctx.jobs.size(); ++k) {
+                const size_t p = size_t(ctx.jobs[k].py) * width + ctx.jobs[k].px;
+                fb.add(p, ctx.colors[k], opts.tone);
+                if (denoised && ctx.jobs[k].sample == 0) {
+                    const sample_guide &g = ctx.job_guides[k];
+                    denoised->set_guides(p, g.normal, g.depth, g.albedo);
+                }
+            }
+            profile.tile_seconds[tile] += std::chrono::duration<double>(clock::now() - tile_start).count();
+        });
+
+        size_t active = 0;
+        total_samples = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const size_t p = size_t(y) * width + x;
+                total_samples += fb.count[p];
+                bool more = fb.count[p] < uint32_t(opts.max_samples) && opts.in_crop(x, y);
+                if (more && fb.count[p] == 1) {
+                    // One sample has no variance yet: refine only where the neighbourhood has an edge.
+                    more = false;
+                    const float l = fb.mean_luminance(p);
+                    for (int dy = -1; dy <= 1 && !more; ++dy) {
+                        for (int dx = -1; dx <= 1 && !more; ++dx) {
+                            const int nx = x + dx, ny = y + dy;
+                            if (nx >= 0 && ny >= 0 && nx < width && ny < height && opts.in_crop(nx, ny))
+                                more = std::fabs(fb.mean_luminance(size_t(ny) * width + nx) - l) > opts.contrast;
+                        }
+                    }
+                } else if (more && fb.count[p] >= uint32_t(opts.min_samples)) {
+                    more = fb.standard_error(p) > opts.tolerance;
+                }
+                fb.active[p] = more;
+                active += more;
+            }
+        }
+
+        const bool out_of_time = limited && clock::now() >= deadline;
+        if (active == 0 || out_of_time)
+            break;
+        if (opts.preview_interval > 0 && clock::now() >= next_preview) {
+            stage_timer timer(profile.encode(opts));
+            std::unique_ptr<image_writer> preview = open_output(opts);
+            if (preview)
+                fb.write(*preview, opts.tone);
+            next_preview = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opts.preview_interval));
+        }
+    }
+
+    if (denoised) {
+        for (size_t p = 0; p < size_t(width) * height; ++p)
+            denoised->set_color(p, fb.mean(p));
+        write_denoised(*denoised, opts, pool, profile, out);
+    } else {
+        stage_timer timer(profile.encode(opts));
+        fb.write(out, opts.tone);
+    }
+    render_result result = profile.report(opts, contexts);
+    result.passes = pass + 1;
+    result.samples = total_samples;
+    return result;
+}
+
+// The output path of a sequence frame, see render_sequence().
+std::string frame_path(const std::string &pattern, int frame) {
+    const size_t slash = pattern.find_last_of('/');
+    const size_t name = slash == std::string::npos ? 0 : slash + 1;
+    size_t first = pattern.find('#', name);
+    size_t digits = 4;
+    std::string prefix, suffix;
+    if (first != std::string::npos) {
+        const size_t last = pattern.find_first_not_of('#', first);
+        digits = (last == std::string::npos ? pattern.size() : last) - first;
+        prefix = pattern.substr(0, first);
+        suffix = pattern.substr(first + digits);
+    } else {
+        const size_t dot = pattern.find_last_of('.');
+        const size_t split = dot == std::string::npos || dot < name ? pattern.size() : dot;
+        prefix = pattern.substr(0, split) + "_";
+        suffix = pattern.substr(split);
+    }
+    char number[32];
+    snprintf(number, sizeof(number), "%0*d", int(digits), frame);
+    return prefix + number + suffix;
+}
+
+// Hands a whole image to out in the bands a streaming render would have used, so the file comes out the same.
+void write_bands(image_writer &out, const memory_writer &image, int width, int height, const tone_mapping &tone) {
+    const int band_rows = 32;
+    std::vector<unsigned char> bytes;
+    for (int y = 0; y < height; y += band_rows) {
+        const int rows = std::min(band_rows, height - y);
+        if (image.takes_float())
+            write_linear_rows(out, image.linear.data() + size_t(y) * width * 3, width, rows, tone, bytes);
+        else
+            out.write_rows(image.pixels.data() + size_t(y) * width * 3, rows);
+    }
+    out.finish();
+}
+
+void write_image(const std::string &path, int width, int height, const memory_writer &image, const tone_mapping &tone) {
+    std::unique_ptr<image_writer> out = open_image_writer(path, width, height);
+    write_bands(*out, image, width, height, tone);
+}
+
+// The 8-bit pixels of image as an 8-bit format would show them.
+std::vector<unsigned char> shown_pixels(const memory_writer &image, const tone_mapping &tone) {
+    if (!image.takes_float())
+        return image.pixels;
+    std::vector<unsigned char> bytes(image.linear.size());
+    tone_map_pixels(image.linear.data(), image.linear.size() / 3, tone, bytes.data());
+    return bytes;
+}
+
+/**
+ * Renders again with exact math and prints how far image (rendered with opts
+ * in seconds) is from that, in 8-bit levels, and how much time it saved.
+ */
+void report_math_error(const scene &sc, const render_options &opts, const memory_writer &image, double seconds) {
+    render_options exact = opts;
+    exact.settings.fast_math = false;
+    exact.stats = false;
+    exact.heatmap.clear();
+    memory_writer reference(opts.width, image.takes_float());
+    const render_result reference_result = render(sc, exact, reference);
+    const std::vector<unsigned char> shown = shown_pixels(image, opts.tone);
+    const std::vector<unsigned char> shown_reference = shown_pixels(reference, opts.tone);
+
+    int worst = 0;
+    double sum = 0, sum2 = 0;
+    size_t over_1 = 0, over_4 = 0;
+    const size_t pixels = size_t(opts.width) * opts.height;
+    for (size_t p = 0; p < pixels; ++p) {
+        int pixel_worst = 0;
+        for (int c = 0; c < 3; ++c) {
+            const int d = std::abs(int(shown[3 * p + c]) - int(shown_reference[3 * p + c]));
+            pixel_worst = std::max(pixel_worst, d);
+            sum += d;
+            sum2 += double(d) * d;
+        }
+        worst = std::max(worst, pixel_worst);
+        over_1 += pixel_worst > 1;
+        over_4 += pixel_worst > 4;
+    }
+    const double rms = std::sqrt(sum2 / (3.0 * pixels));
+    std::cout << "math error: max " << worst << ", mean " << sum / (3.0 * pixels) << ", PSNR ";
+    if (rms > 0)
+        std::cout << 20 * std::log10(255 / rms) << " dB";
+    else
+        std::cout << "inf";
+    std::cout << "; pixels off by more than 1: " << 100.0 * over_1 / pixels << "%, more than 4: " << 100.0 * over_4 / pixels
+              << "%; time " << seconds << " s vs " << reference_result.seconds << " s exact" << std::endl;
+}
+
+// Opens the file on the first row, so progressive previews of the same path are done with by then.
+class deferred_writer : public image_writer {
+public:
+    explicit deferred_writer(const render_options &opts) : opts_(opts) {}
+
+    void write_rows(const unsigned char *rows, int count) {
+        if (!out_)
+            out_ = open_image_writer(opts_.output, opts_.width, opts_.height, opts_.threads);
+        out_->write_rows(rows, count);
+    }
+    void finish() {
+        if (!out_)
+            out_ = open_image_writer(opts_.output, opts_.width, opts_.height, opts_.threads);
+        out_->finish();
+    }
+
+    bool takes_float() const { return is_float_format(opts_.output); }
+    void write_float_rows(const float *rows, int count) {
+        if (!out_)
+            out_ = open_image_writer(opts_.output, opts_.width, opts_.height, opts_.threads);
+        out_->write_float_rows(rows, count);
+    }
+
+private:
+    const render_options &opts_;
+    std::unique_ptr<image_writer> out_;
+};
+
+} // namespace
+
+render_result render(const scene &sc, const render_options &opts, image_writer &out) {
+    return opts.max_samples > 0 ? render_progressive(sc, opts, out) : render_streaming(sc, opts, out);
+}
+
+int render(const scene &sc, const render_options &opts) {
+    try {
+        std::unique_ptr<image_writer> out;
+        if (opts.max_samples > 0 || opts.math_error)
+            out.reset(new deferred_writer(opts));
+        else
+            out = open_image_writer(opts.output, opts.width, opts.height, opts.threads);     // fail before rendering
+        render_result result;
+        if (opts.math_error) {
+            memory_writer image(opts.width, out->takes_float());
+            result = render(sc, opts, image);
+            report_math_error(sc, opts, image, result.seconds);
+            write_bands(*out, image, opts.width, opts.height, opts.tone);
+        } else {
+            result = render(sc, opts, *out);
+        }
+        if (opts.max_samples > 0)
+            std::cout << "progressive: " << result.passes << " passes, " << result.samples << " samples ("
+                      << double(result.samples) / (double(opts.width) * opts.height) << " per pixel) in "
+                      << result.seconds << " s" << std::endl;
+    } catch (const image_error &e) {
+        std::cerr << e.what() << std::endl;
+        std::cout << "failed!" << std::endl;
+        return 1;
+    }
+    std::cout << "success!" << std::endl;
+    return 0;
+}
+
+int merge_images(const std::vector<std::string> &inputs, const std::string &output, const tone_mapping &tone) {
+    try {
+        int width = 0, height = 0;
+        std::vector<vec3> sum, rgb;
+        for (const std::string &path : inputs) {
+            int w, h;
+            load_image(path, w, h, rgb);
+            if (sum.empty()) {
+                width = w;
+                height = h;
+                sum.assign(rgb.size(), vec3());
+            } else if (w != width || h != height) {
+                throw image_error(path + ": " + std::to_string(w) + "x" + std::to_string(h) + ", the first image is "
+                                  + std::to_string(width) + "x" + std::to_string(height));
+            }
+            for (size_t p = 0; p < sum.size(); ++p)
+                sum[p] = sum[p] + rgb[p];
+        }
+        std::unique_ptr<image_writer> out = open_image_writer(output, width, height);
+        const int band_rows = 32;
+        std::vector<float> band(size_t(width) * band_rows * 3);
+        std::vector<unsigned char> bytes;
+        for (int y0 = 0; y0 < height; y0 += band_rows) {
+            const int rows = std::min(band_rows, height - y0);
+            for (size_t k = 0; k < size_t(width) * rows; ++k) {
+                const vec3 &c = sum[size_t(y0) * width + k];
+                band[3*k + 0] = c.x;
+                band[3*k + 1] = c.y;
+                band[3*k + 2] = c.z;
+            }
+            write_linear_rows(*out, band.data(), width, rows, tone, bytes);
+        }
+        out->finish();
+        std::cout << "merged " << inputs.size() << " images of " << width << "x" << height << " into " << output << std::endl;
+    } catch (const std::runtime_error &e) {     // texture_error from reading, image_error from writing
+        std::cerr << e.what() << std::endl;
+        std::cout << "failed!" << std::endl;
+        return 1;
+    }
+    std::cout << "success!" << std::endl;
+    return 0;
+}
+
+struct tile_renderer::state {
+    const scene &sc;
+    const render_options &opts;
+    const packet_tracer tracer;
+    trace_context ctx;
+
+    state(const scene &s, const render_options &o) : sc(s), opts(o), tracer(select_packet_tracer(o.simd)), ctx(s, o.settings) {}
+};
+
+tile_renderer::tile_renderer(const scene &sc, const render_options &opts) : state_(new state(sc, opts)) {}
+
+tile_renderer::~tile_renderer() {}
+
+void tile_renderer::render(int x0, int y0, int x1, int y1, float *rgb) {
+    trace_context &ctx = state_->ctx;
+    const render_options &opts = state_->opts;
+    if (opts.crop_x1 > 0)
+        std::fill(rgb, rgb + size_t(x1 - x0) * (y1 - y0) * 3, 0.f);
+    tile_jobs(x0, y0, x1, y1, state_->tracer,
+              [&](int x, int y, uint32_t &first, uint32_t &count) { first = 0; count = opts.in_crop(x, y); }, ctx.jobs);
+    trace_samples(state_->sc, opts.cam, opts.width, opts.height, state_->tracer, ctx);
+    for (size_t k = 0; k < ctx.jobs.size(); ++k) {
+        const vec3 &color = ctx.colors[k];
+        float *pixel = rgb + (size_t(ctx.jobs[k].px - x0) + size_t(ctx.jobs[k].py - y0) * (x1 - x0)) * 3;
+        pixel[0] = color.x;
+        pixel[1] = color.y;
+        pixel[2] = color.z;
+    }
+}
+
+const ray_counters &tile_renderer::rays() const {
+    return state_->ctx.counters;
+}
+
+int render_sequence(scene &sc, const render_options &opts, const sequence &seq) {
+    typedef std::chrono::steady_clock clock;
+    render_options frame_opts = opts;
+    frame_opts.preview_interval = 0;        // frames only exist in memory until they are encoded
+
+    // Frame f is traced into buffers[f % 2] while frame f - 1 is encoded from the other one.
+    std::unique_ptr<memory_writer> buffers[2];
+    std::future<void> encoding;
+    const clock::time_point start = clock::now();
+    int refits = 0;
+    try {
+        for (int frame = 0; frame < seq.frames; ++frame) {
+            const clock::time_point frame_start = clock::now();
+            seq.apply(frame, sc, frame_opts.cam);
+            const bool refit = sc.update_accel();
+            refits += refit;
+            const double accel_seconds = std::chrono::duration<double>(clock::now() - frame_start).count();
+            if (!frame_opts.cam.valid())
+                throw image_error("frame " + std::to_string(frame) + ": camera has no valid view direction");
+            if (!opts.heatmap.empty())
+                frame_opts.heatmap = frame_path(opts.heatmap, frame);
+
+            std::unique_ptr<memory_writer> &buffer = buffers[frame % 2];
+            buffer.reset(new memory_writer(opts.width, is_float_format(opts.output)));
+            if (buffer->takes_float())
+                buffer->linear.reserve(size_t(opts.width) * opts.height * 3);
+            else
+                buffer->pixels.reserve(size_t(opts.width) * opts.height * 3);
+            const render_result result = render(sc, frame_opts, *buffer);
+
+            if (encoding.valid())
+                encoding.get();     // rethrows a failed write
+            const std::string path = frame_path(opts.output, frame);
+            const memory_writer &image = *buffer;
+            encoding = std::async(std::launch::async, [path, &opts, &image] {
+                write_image(path, opts.width, opts.height, image, opts.tone);
+            });
+            std::cout << "frame " << frame << ": " << path << ", " << (refit ? "refit " : "rebuild ")
+                      << accel_seconds * 1e3 << " ms, render " << result.seconds * 1e3 << " ms" << std::endl;
+        }
+        if (encoding.valid())
+            encoding.get();
+    } catch (const image_error &e) {
+        if (encoding.valid())
+            encoding.wait();
+        std::cerr << e.what() << std::endl;
+        std::cout << "failed!" << std::endl;
+        return 1;
+    }
+    const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    std::cout << "sequence: " << seq.frames << " frames (" << refits << " refits) in " << seconds << " s, "
+              << seconds / seq.frames * 1e3 << " ms per frame" << std::endl;
+    std::cout << "success!" << std::endl;
+    return 0;
+}
+
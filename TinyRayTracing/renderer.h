@@ -0,0 +1,118 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "denoise.h"
+#include "image_writer.h"
+#include "render_stats.h"
+#include "scene.h"
+#include "sequence.h"
+#include "tonemap.h"
+
+struct trace_settings {
+    int   max_depth  = 4;       // rays deeper than this return the background color
+    float min_weight = 1e-3f;   // secondary rays contributing less than this are not traced
+    bool  roulette   = false;   // Russian roulette on low-weight rays, unbiased but noisy
+    int   roulette_depth  = 2;
+    float roulette_weight = 0.1f;
+    bool  fast_math  = false;   // approximate rsqrt and pow in shading, see fast_math.h
+    bool  wavefront  = false;   // trace secondary rays bounce by bounce in sorted packets instead of depth first
+    int   light_samples = 0;    // > 0: shadow rays to this many lights per hit, picked from scene::light_accel, instead of one to every light
+};
+
+struct render_options {
+    int    width  = 1200;
+    int    height = 800;
+    camera cam;
+    std::string output = "out.png";     // .png, .ppm and .pfm are streamed band by band, see image_writer
+    tone_mapping tone;                  // for 8-bit formats; .pfm keeps the linear colors
+    size_t threads = 0;                 // 0 = one per hardware thread
+    std::string simd = "auto";          // packet kernel, see select_packet_tracer
+    trace_settings settings;
+
+    // Progressive rendering, see render_progressive(). 0 keeps the single sample streaming render.
+    int    max_samples = 0;             // per pixel
+    int    min_samples = 4;             // a pixel needs this many before it can count as converged
+    float  tolerance   = 1.f / 255;     // standard error of the pixel mean at which a pixel is converged
+    float  contrast    = 0.05f;         // luminance step to a neighbour that makes a pixel adaptive after the first pass
+    double time_limit  = 0;             // seconds, 0 = until converged
+    double preview_interval = 0;        // seconds between intermediate images, 0 = none
+
+    bool   stats = false;               // print ray counts and stage times, see render_profile
+    std::string heatmap;                // image of per-tile render time, empty = none
+    bool   math_error = false;          // also render with exact math and report how far the image is off
+
+    // Rectangle [x0, x1) x [y0, y1) to render, x1 = 0 for the whole image. Pixels outside it are black,
+    // so float images of disjoint crops add up to the whole image, see merge_images().
+    int    crop_x0 = 0, crop_y0 = 0, crop_x1 = 0, crop_y1 = 0;
+    bool   in_crop(int x, int y) const {
+        return crop_x1 == 0 || (x >= crop_x0 && x < crop_x1 && y >= crop_y0 && y < crop_y1);
+    }
+
+    bool   denoise = false;             // filter the finished image, guided by the primary hits, see denoise.h
+    denoise_settings denoiser;
+};
+
+struct render_result {
+    ray_counters rays;          // summed over all threads
+    double seconds = 0;         // wall time of the render, encoding included
+    int    passes = 1;
+    size_t samples = 0;         // primary rays, more than one per pixel in progressive mode
+};
+
+/**
+ * Renders sc as described by opts into out, single sample streaming or
+ * progressive (opts.max_samples > 0). The scene's acceleration structure must
+ * be built. Prints the --stats summary and writes the heatmap if asked for.
+ * Throws image_error when writing fails.
+ */
+render_result render(const scene &sc, const render_options &opts, image_writer &out);
+
+// Command line flavour: renders to opts.output and prints "success!" or "failed!". Returns the exit code.
+int render(const scene &sc, const render_options &opts);
+
+/**
+ * Adds up float images (PFM) of one size pixel by pixel and writes the sum to
+ * output, tone mapped unless that is a float format too. Renders of disjoint
+ * crops are black outside them, so this joins them into the whole image with
+ * nothing lost. Prints "success!" or "failed!". Returns the exit code.
+ */
+int merge_images(const std::vector<std::string> &inputs, const std::string &output, const tone_mapping &tone);
+
+/**
+ * Renders any rectangle of the single sample image on the calling thread,
+ * pixel for pixel the linear colors render() writes there. For callers that deal out the
+ * tiles themselves, such as the workers in distributed.h.
+ */
+class tile_renderer {
+public:
+    // The scene's acceleration structure must be built; sc must outlive the renderer.
+    tile_renderer(const scene &sc, const render_options &opts);
+    ~tile_renderer();
+
+    // Writes the linear RGB colors of pixels [x0, x1) x [y0, y1) to rgb, row after row.
+    void render(int x0, int y0, int x1, int y1, float *rgb);
+
+    const ray_counters &rays() const;
+
+private:
+    struct state;
+    std::unique_ptr<state> state_;
+};
+
+/**
+ * Renders every frame of seq, posing sc and the camera for it first. The
+ * acceleration structure is refit rather than rebuilt where possible, and
+ * each frame is encoded on a separate thread while the next one is traced.
+ * Frame f goes to opts.output with a run of '#' replaced by f zero-padded to
+ * the run's length, or with "_0000" (4 digits) inserted before the extension.
+ * Returns the exit code.
+ */
+int render_sequence(scene &sc, const render_options &opts, const sequence &seq);
+
+#endif
@@ -0,0 +1,540 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "light_tree.h"
+#include "render_stats.h"
+#include "texture.h"
+#include "triangle.h"
+
+struct light {
+    light(const vec3 &p, const float &i) : position(p), intensity(i) {}
+    vec3 position;
+    float intensity;
+};
+
+struct material {
+    material(const float &r, const vec3 &a, const float &a3, const vec3 &color, const float &spec) 
+        : refractive_index(r)
+        , albedo(a)
+        , albedo3(a3)
+        , diffuse_color(color)
+        , specular_exponent(spec) {}
+    material() : refractive_index(1), albedo(1, 0, 0), albedo3(0), diffuse_color(), specular_exponent() {}
+    float refractive_index;
+    vec3 albedo;
+    float albedo3;
+    vec3 diffuse_color;
+    float specular_exponent;
+    int32_t texture = -1;       // into scene::textures, multiplies diffuse_color; -1 = none
+    float texture_scale = 1;    // world units per repeat of the texture on planes
+    float checker_size = 0;     // > 0: on planes every other square this many units wide is checker_color instead of diffuse_color
+    vec3  checker_color;
+};
+
+
+struct sphere {
+    vec3  center;
+    float radius;
+    uint32_t material_id;       // into scene::materials
+    
+    sphere(const vec3 &c, const float &r, uint32_t m) : center(c), radius(r), material_id(m) {}
+
+    /**
+     * orig：光线的起点（原点）。
+     * dir：光线的方向（单位向量）。
+     * t0：用于存储相交点距离光线起点的距离。
+     */
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const {
+        vec3 L = center - orig;                     // 起点到球心的向量
+        float tca = L * dir;                        // L 在光线方向 dir 上的投影长度
+        float d2 = L*L - tca*tca;                   // 球心到光线方向的垂直距离
+        if (d2 > radius * radius)                   // 判断光线是否与球相交
+            return false;
+        float thc = sqrtf(radius * radius - d2);    // 与球的两个交点之间距离的一半
+        t0 = tca - thc;                             // 第一个交点距离原点的距离
+        float t1 = tca + thc;                       // 第二个交点距离原点的距离
+        if (t0 < 0) t0 = t1;                        // 处理光线起点在球体的内部的情况，如果第一个交点 t0 小于 0，说明第一个交点在光线的起点后面。
+        if (t0 < 0) return false;                   // 如果更新后的 t0 仍然小于 0，说明两个交点都在光线的起点后面，光线与球体相交但在起点后方。此时认为没有有效的交点，返回 false。
+        return true;
+    }
+
+    aabb bounds() const {
+        aabb b;
+        b.expand(center - vec3(radius, radius, radius));
+        b.expand(center + vec3(radius, radius, radius));
+        return b;
+    }
+};
+
+// Axis of v with the largest magnitude.
+inline int dominant_axis(const vec3 &v) {
+    const float ax = fabs(v.x), ay = fabs(v.y), az = fabs(v.z);
+    return ax >= ay && ax >= az ? 0 : ay >= az ? 1 : 2;
+}
+
+/**
+ * A plane, or the part of one inside extent. Only the two axes the normal
+ * is least aligned with are clipped, so a floor at y = -4 is bounded by its
+ * x and z range whatever extent says about y. Bounded planes go into the BVH,
+ * unbounded ones are tested by every ray.
+ */
+struct plane {
+    vec3  normal;       // unit length; the plane holds the points p with normal * p == offset
+    float offset;
+    uint32_t material_id;
+    aabb  extent;       // empty: unbounded
+
+    plane(const vec3 &n, const float &d, uint32_t m) : normal(n), offset(d), material_id(m) {}
+    plane(const vec3 &n, const float &d, uint32_t m, const aabb &clip) : normal(n), offset(d), material_id(m), extent(clip) {}
+
+    bool bounded() const { return extent.min.x <= extent.max.x; }
+
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const {
+        float denom = normal * dir;
+        if (fabs(denom) < 1e-6f)
+            return false;
+        t0 = (offset - normal * orig) / denom;
+        if (!(t0 > 0))
+            return false;
+        if (!bounded())
+            return true;
+        const vec3 p = orig + dir * t0;
+        const int a = dominant_axis(normal);
+        for (int i = 1; i < 3; ++i) {
+            const int k = (a + i) % 3;
+            if (!(p[k] > extent.min[k] && p[k] < extent.max[k]))
+                return false;
+        }
+        return true;
+    }
+
+    // Of a bounded plane: extent, with the dominant axis narrowed to where the plane crosses it.
+    aabb bounds() const {
+        const int a = dominant_axis(normal), b = (a + 1) % 3, c = (a + 2) % 3;
+        aabb box;
+        for (int corner = 0; corner < 4; ++corner) {
+            vec3 p;
+            p[b] = corner & 1 ? extent.max[b] : extent.min[b];
+            p[c] = corner & 2 ? extent.max[c] : extent.min[c];
+            p[a] = (offset - normal[b] * p[b] - normal[c] * p[c]) / normal[a];
+            box.expand(p);
+        }
+        // Rounding must not let the node boxes cut off hits the plane test finds.
+        const float pad = 1e-4f * (1 + std::max(fabs(box.min[a]), fabs(box.max[a])));
+        box.min[a] -= pad;
+        box.max[a] += pad;
+        return box;
+    }
+};
+
+// Axis-aligned box, solid: a ray starting inside hits its far side.
+struct box {
+    aabb extent;
+    uint32_t material_id;
+
+    box(const aabb &e, uint32_t m) : extent(e), material_id(m) {}
+
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const {
+        float tnear = -std::numeric_limits<float>::max(), tfar = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; ++a) {
+            const float inv = 1.f / dir[a];
+            float t1 = (extent.min[a] - orig[a]) * inv;
+            float t2 = (extent.max[a] - orig[a]) * inv;
+            if (inv < 0) std::swap(t1, t2);
+            tnear = std::max(tnear, t1);
+            tfar = std::min(tfar, t2);
+        }
+        if (!(tnear <= tfar) || tfar <= 0)
+            return false;
+        t0 = tnear > 0 ? tnear : tfar;
+        return true;
+    }
+
+    // Outward normal of the face closest to p.
+    vec3 normal(const vec3 &p) const {
+        int axis = 0;
+        float best = std::numeric_limits<float>::max(), sign = 1;
+        for (int a = 0; a < 3; ++a) {
+            const float lo = fabs(p[a] - extent.min[a]), hi = fabs(p[a] - extent.max[a]);
+            if (lo < best) { best = lo; axis = a; sign = -1; }
+            if (hi < best) { best = hi; axis = a; sign = 1; }
+        }
+        vec3 n;
+        n[axis] = sign;
+        return n;
+    }
+
+    aabb bounds() const { return extent; }
+};
+
+/**
+ * Quadric surface a x^2 + b y^2 + c z^2 + d xy + e yz + f xz + g x + h y + i z + j = 0,
+ * coefficients in that order, clipped to extent. Spheres, ellipsoids,
+ * cylinders, cones and paraboloids are all quadrics; the unbounded ones need
+ * the clip to go into the BVH. Outside is where the left-hand side is positive.
+ */
+struct quadric {
+    float q[10];
+    aabb extent;
+    uint32_t material_id;
+
+    quadric(const float coefficients[10], const aabb &clip, uint32_t m) : extent(clip), material_id(m) {
+        std::copy(coefficients, coefficients + 10, q);
+    }
+
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const {
+        const vec3 &o = orig, &v = dir;
+        const float A = q[0]*v.x*v.x + q[1]*v.y*v.y + q[2]*v.z*v.z + q[3]*v.x*v.y + q[4]*v.y*v.z + q[5]*v.x*v.z;
+        const float B = 2 * (q[0]*o.x*v.x + q[1]*o.y*v.y + q[2]*o.z*v.z) + q[3] * (o.x*v.y + o.y*v.x)
+                      + q[4] * (o.y*v.z + o.z*v.y) + q[5] * (o.x*v.z + o.z*v.x) + q[6]*v.x + q[7]*v.y + q[8]*v.z;
+        const float C = value(o);
+        float roots[2];
+        int count = 0;
+        if (fabs(A) < 1e-9f) {
+            if (B == 0)
+                return false;
+            roots[count++] = -C / B;
+        } else {
+            const float disc = B*B - 4*A*C;
+            if (disc < 0)
+                return false;
+            // The stable form: no cancellation between B and the square root.
+            const float s = -0.5f * (B + (B < 0 ? -sqrtf(disc) : sqrtf(disc)));
+            const float r1 = s / A, r2 = s != 0 ? C / s : r1;
+            roots[count++] = std::min(r1, r2);
+            roots[count++] = std::max(r1, r2);
+        }
+        for (int k = 0; k < count; ++k) {
+            if (!(roots[k] > 0))
+                continue;
+            const vec3 p = orig + dir * roots[k];
+            if (p.x >= extent.min.x && p.x <= extent.max.x && p.y >= extent.min.y && p.y <= extent.max.y
+                && p.z >= extent.min.z && p.z <= extent.max.z) {
+                t0 = roots[k];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    float value(const vec3 &p) const {
+        return q[0]*p.x*p.x + q[1]*p.y*p.y + q[2]*p.z*p.z + q[3]*p.x*p.y + q[4]*p.y*p.z + q[5]*p.x*p.z
+             + q[6]*p.x + q[7]*p.y + q[8]*p.z + q[9];
+    }
+
+    // Unit gradient at p, pointing outside.
+    vec3 normal(const vec3 &p) const {
+        return vec3(2*q[0]*p.x + q[3]*p.y + q[5]*p.z + q[6],
+                    2*q[1]*p.y + q[3]*p.x + q[4]*p.z + q[7],
+                    2*q[2]*p.z + q[4]*p.y + q[5]*p.x + q[8]).normalized();
+    }
+
+    aabb bounds() const { return extent; }
+};
+
+/**
+ * Indexed triangle mesh with vertex attributes in structure-of-arrays form.
+ * Triangle k uses the vertices indices[3k], indices[3k+1] and indices[3k+2].
+ */
+struct mesh {
+    std::vector<float> px, py, pz;
+    std::vector<float> nx, ny, nz;      // per-vertex normals, empty when the source had none
+    std::vector<uint32_t> indices;
+    uint32_t material_id = 0;
+
+    size_t vertex_count() const { return px.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+    bool has_normals() const { return !nx.empty(); }
+
+    vec3 vertex(uint32_t i) const { return vec3(px[i], py[i], pz[i]); }
+
+    /**
+     * Normal at barycentrics (u, v) of triangle tri: interpolated from the
+     * vertex normals when there are any, the face normal (counter-clockwise
+     * winding faces out) otherwise.
+     */
+    vec3 shading_normal(uint32_t tri, float u, float v) const {
+        const uint32_t i0 = indices[3*tri], i1 = indices[3*tri + 1], i2 = indices[3*tri + 2];
+        if (has_normals()) {
+            const float w = 1.f - u - v;
+            return (vec3(nx[i0], ny[i0], nz[i0]) * w + vec3(nx[i1], ny[i1], nz[i1]) * u
+                    + vec3(nx[i2], ny[i2], nz[i2]) * v).normalized();
+        }
+        return cross(vertex(i1) - vertex(i0), vertex(i2) - vertex(i0)).normalized();
+    }
+};
+
+/**
+ * References stored in bvh::prims. Spheres are plain indices into
+ * scene::soa, triangles have prim_triangle set and index scene::tris, and
+ * the other shapes have prim_shape set, their shape_kind in the two bits
+ * below it and index scene::planes, boxes or quadrics. Bit 30 rather than 31
+ * keeps every reference a non-negative int32_t.
+ */
+const uint32_t prim_triangle = 1u << 30;
+const uint32_t prim_shape    = 1u << 29;
+
+enum shape_kind { shape_plane, shape_box, shape_quadric };
+
+const int      shape_kind_shift = 27;
+const uint32_t shape_index_mask = (1u << shape_kind_shift) - 1;
+
+inline uint32_t shape_prim(shape_kind kind, uint32_t index) { return prim_shape | uint32_t(kind) << shape_kind_shift | index; }
+inline shape_kind prim_shape_kind(uint32_t ref) { return shape_kind((ref >> shape_kind_shift) & 3); }
+
+/**
+ * Sphere geometry in structure-of-arrays form, stored in BVH leaf order so a
+ * leaf's spheres are contiguous. This is all intersection tests touch; the
+ * sphere itself and its material are only looked up for the closest hit.
+ * The packet tracer broadcasts one sphere of it against several rays.
+ */
+struct sphere_soa {
+    std::vector<float> cx, cy, cz, r2;
+    std::vector<uint32_t> index;        // into scene::spheres
+};
+
+// sphere::ray_intersect() on sphere k of soa, with the same arithmetic.
+inline bool intersect_sphere(const sphere_soa &soa, uint32_t k, const vec3 &orig, const vec3 &dir, float &t0) {
+    const vec3 L(soa.cx[k] - orig.x, soa.cy[k] - orig.y, soa.cz[k] - orig.z);
+    const float tca = L * dir;
+    const float d2 = L*L - tca*tca;
+    if (d2 > soa.r2[k])
+        return false;
+    const float thc = sqrtf(soa.r2[k] - d2);
+    t0 = tca - thc;
+    const float t1 = tca + thc;
+    if (t0 < 0) t0 = t1;
+    return t0 >= 0;
+}
+
+/**
+ * Geometry refers to shading data by index into `materials`, which keeps the
+ * primitives small and leaves materials out of the intersection loops.
+ */
+struct scene {
+    std::vector<material> materials;
+    texture_cache textures;
+    int32_t environment = -1;           // latitude-longitude map in textures seen by rays that miss; -1 = plain background
+    float   environment_intensity = 1;
+    std::vector<sphere> spheres;
+    std::vector<light>  lights;
+    std::vector<plane>  planes;
+    std::vector<box>    boxes;
+    std::vector<quadric> quadrics;
+    std::vector<mesh>   meshes;
+    bvh accel;          // over spheres, bounded planes, boxes, quadrics and mesh triangles, rebuilt by build_accel() after they change
+    sphere_soa soa;
+    triangle_soa tris;
+    std::vector<uint32_t> shapes;       // prim_shape references in build order
+    light_tree light_accel;             // over lights, for many-light sampling; rebuilt with accel
+    float built_cost = 0;       // accel.cost() right after the last build, see update_accel()
+
+    uint32_t add_material(const material &m) {
+        materials.push_back(m);
+        return uint32_t(materials.size() - 1);
+    }
+
+    void build_accel() {
+        // Primitive i < spheres.size() is a sphere, then come the shapes, then the triangles of all meshes in order.
+        shapes.clear();
+        for (uint32_t i = 0; i < planes.size(); ++i) {
+            if (planes[i].bounded())
+                shapes.push_back(shape_prim(shape_plane, i));
+        }
+        for (uint32_t i = 0; i < boxes.size(); ++i)
+            shapes.push_back(shape_prim(shape_box, i));
+        for (uint32_t i = 0; i < quadrics.size(); ++i)
+            shapes.push_back(shape_prim(shape_quadric, i));
+        std::vector<uint32_t> mesh_first;
+        size_t triangles = 0;
+        for (const mesh &m : meshes) {
+            mesh_first.push_back(uint32_t(triangles));
+            triangles += m.triangle_count();
+        }
+        std::vector<aabb> bounds;
+        bounds.reserve(spheres.size() + shapes.size() + triangles);
+        for (const sphere &s : spheres)
+            bounds.push_back(s.bounds());
+        for (uint32_t ref : shapes)
+            bounds.push_back(shape_bounds(ref));
+        for (const mesh &m : meshes) {
+            for (size_t i = 0; i < m.indices.size(); i += 3) {
+                aabb b;
+                b.expand(m.vertex(m.indices[i]));
+                b.expand(m.vertex(m.indices[i + 1]));
+                b.expand(m.vertex(m.indices[i + 2]));
+                bounds.push_back(b);
+            }
+        }
+        accel.build(bounds);
+
+        // Every leaf holds its spheres, then its shapes, then its triangles, so the triangles form one run for the SIMD test.
+        const uint32_t sphere_count = uint32_t(spheres.size());
+        const uint32_t shape_end = sphere_count + uint32_t(shapes.size());
+        for (const bvh_node &node : accel.nodes) {
+            if (node.is_leaf())
+                std::stable_sort(accel.prims.begin() + node.offset, accel.prims.begin() + node.offset + node.count,
+                                 [&](uint32_t a, uint32_t b) { return (a >= sphere_count) + (a >= shape_end) < (b >= sphere_count) + (b >= shape_end); });
+        }
+
+        soa = sphere_soa();
+        tris = triangle_soa();
+        for (uint32_t &p : accel.prims) {
+            if (p < sphere_count) {
+                const sphere &s = spheres[p];
+                soa.cx.push_back(s.center.x);
+                soa.cy.push_back(s.center.y);
+                soa.cz.push_back(s.center.z);
+                soa.r2.push_back(s.radius * s.radius);
+                soa.index.push_back(p);
+                p = uint32_t(soa.index.size() - 1);
+            } else if (p < shape_end) {
+                p = shapes[p - sphere_count];
+            } else {
+                const uint32_t global = p - shape_end;
+                const uint32_t mi = uint32_t(std::upper_bound(mesh_first.begin(), mesh_first.end(), global) - mesh_first.begin() - 1);
+                const mesh &m = meshes[mi];
+                const uint32_t t = global - mesh_first[mi];
+                tris.push_back(m.vertex(m.indices[3*t]), m.vertex(m.indices[3*t + 1]), m.vertex(m.indices[3*t + 2]), mi, t);
+                p = uint32_t(tris.size() - 1) | prim_triangle;
+            }
+        }
+        tris.finish();
+        built_cost = accel.cost();
+        build_light_tree();
+    }
+
+    void build_light_tree() {
+        std::vector<vec3> positions;
+        std::vector<float> intensities;
+        for (const light &l : lights) {
+            positions.push_back(l.position);
+            intensities.push_back(l.intensity);
+        }
+        light_accel.build(positions, intensities);
+    }
+
+    aabb shape_bounds(uint32_t ref) const {
+        const uint32_t i = ref & shape_index_mask;
+        switch (prim_shape_kind(ref)) {
+        case shape_plane: return planes[i].bounds();
+        case shape_box:   return boxes[i].bounds();
+        default:          return quadrics[i].bounds();
+        }
+    }
+
+    /**
+     * Catches the acceleration structure up with moved or resized spheres.
+     * Refits the existing tree when the primitives are the same ones it was
+     * built over, and rebuilds when they were added or removed or when the
+     * refitted tree got refit_limit times as expensive as the fresh one was.
+     * Returns true for a refit.
+     */
+    bool update_accel() {
+        const float refit_limit = 1.5f;
+        size_t triangles = 0;
+        for (const mesh &m : meshes)
+            triangles += m.triangle_count();
+        build_light_tree();     // cheap next to the BVH, and the lights may have moved too
+        size_t bounded_planes = 0;
+        for (const plane &pl : planes)
+            bounded_planes += pl.bounded();
+        if (accel.empty() || soa.index.size() != spheres.size() || shapes.size() != bounded_planes + boxes.size() + quadrics.size()
+            || tris.size() != triangles) {
+            build_accel();
+            return false;
+        }
+        for (size_t k = 0; k < soa.index.size(); ++k) {
+            const sphere &s = spheres[soa.index[k]];
+            soa.cx[k] = s.center.x;
+            soa.cy[k] = s.center.y;
+            soa.cz[k] = s.center.z;
+            soa.r2[k] = s.radius * s.radius;
+        }
+        accel.refit([&](uint32_t p) {
+            if (p & prim_shape)
+                return shape_bounds(p);
+            if (!(p & prim_triangle))
+                return spheres[soa.index[p]].bounds();
+            const uint32_t t = p & ~prim_triangle;
+            aabb b;
+            for (int i = 0; i < 3; ++i)
+                b.expand(vec3(tris.v[i][0][t], tris.v[i][1][t], tris.v[i][2][t]));
+            return b;
+        });
+        if (accel.cost() > refit_limit * built_cost) {
+            build_accel();
+            return false;
+        }
+        return true;
+    }
+};
+
+// Ray test against the bounded plane, box or quadric that the prim_shape reference ref names.
+inline bool intersect_shape(const scene &sc, uint32_t ref, const vec3 &orig, const vec3 &dir, float &t0) {
+    const uint32_t i = ref & shape_index_mask;
+    switch (prim_shape_kind(ref)) {
+    case shape_plane: return sc.planes[i].ray_intersect(orig, dir, t0);
+    case shape_box:   return sc.boxes[i].ray_intersect(orig, dir, t0);
+    default:          return sc.quadrics[i].ray_intersect(orig, dir, t0);
+    }
+}
+
+/**
+ * Closest sphere, shape or triangle along the ray as a bvh::prims reference,
+ * or -1. dist is left at float max on a miss; u and v are the barycentrics
+ * of a triangle hit (see intersect_triangle), 0 for anything else. Tests are tallied in counters
+ * when it is not null.
+ */
+inline int32_t closest_prim(const scene &sc, const vec3 &orig, const vec3 &dir, float &dist, float &u, float &v,
+                            ray_counters *counters = nullptr) {
+    int32_t closest = -1;
+    dist = std::numeric_limits<float>::max();
+    u = v = 0;
+    const watertight_ray wr(orig, dir);
+    uint32_t spheres = 0, shapes = 0, triangles = 0;
+    const uint32_t boxes = sc.accel.traverse_leaves(orig, dir, dist, [&](uint32_t first, uint32_t count, float &tmax) {
+        uint32_t k = first;
+        for (; k < first + count && !(sc.accel.prims[k] & (prim_triangle | prim_shape)); ++k) {
+            const uint32_t s = sc.accel.prims[k];
+            float dist_i;
+            if (intersect_sphere(sc.soa, s, orig, dir, dist_i) && dist_i < tmax) {
+                tmax = dist_i;
+                closest = int32_t(s);
+                u = v = 0;      // a triangle hit in an earlier leaf may have set them
+            }
+        }
+        spheres += k - first;
+        const uint32_t shapes_first = k;
+        for (; k < first + count && (sc.accel.prims[k] & prim_shape); ++k) {
+            float dist_i;
+            if (intersect_shape(sc, sc.accel.prims[k], orig, dir, dist_i) && dist_i < tmax) {
+                tmax = dist_i;
+                closest = int32_t(sc.accel.prims[k]);
+                u = v = 0;
+            }
+        }
+        shapes += k - shapes_first;
+        triangles += first + count - k;
+        uint32_t hit;
+        if (k < first + count && intersect_triangles<false>(sc.tris, sc.accel.prims[k] & ~prim_triangle, first + count - k, wr, tmax, hit, u, v))
+            closest = int32_t(hit | prim_triangle);
+        return false;
+    });
+    if (counters) {
+        counters->box_tests += boxes;
+        counters->sphere_tests += spheres;
+        counters->shape_tests += shapes;
+        counters->triangle_tests += triangles;
+    }
+    return closest;
+}
+
+#endif
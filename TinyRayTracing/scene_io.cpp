@@ -0,0 +1,686 @@
+#include "scene_io.h"
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+
+// The last character before the terminator is the format version, see load_scene_binary().
+const char binary_magic[8] = { 'T', 'R', 'T', 'S', 'C', 'N', '3', '\0' };
+const size_t binary_version_at = 6;
+
+// ---------------------------------------------------------------------------
+// OBJ parsing. Hand-rolled number parsing over a chunked read buffer: strtof
+// and iostreams are several times slower, and a multi-million triangle file
+// should never have to sit in memory as a whole.
+
+inline void skip_blanks(const char *&p) {
+    while (*p == ' ' || *p == '\t')
+        ++p;
+}
+
+inline bool parse_float(const char *&p, float &out) {
+    skip_blanks(p);
+    const char *start = p;
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+    double value = 0;
+    while (*p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    if (*p == '.') {
+        ++p;
+        double scale = 0.1;
+        while (*p >= '0' && *p <= '9') {
+            value += (*p++ - '0') * scale;
+            scale *= 0.1;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        ++p;
+        bool neg_exp = false;
+        if (*p == '-' || *p == '+')
+            neg_exp = *p++ == '-';
+        int exponent = 0;
+        while (*p >= '0' && *p <= '9')
+            exponent = exponent * 10 + (*p++ - '0');
+        value *= std::pow(10.0, neg_exp ? -exponent : exponent);
+    }
+    out = float(negative ? -value : value);
+    return p != start;
+}
+
+inline bool parse_int(const char *&p, long &out) {
+    const char *start = p;
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+    long value = 0;
+    while (*p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    out = negative ? -value : value;
+    return p != start;
+}
+
+/**
+ * Builds the indexed SoA mesh while the file streams by. OBJ indexes
+ * positions and normals separately; a position reused with a different
+ * normal is split into an extra vertex. Such vertices are numbered with
+ * split_flag until all positions are known and appended at the end.
+ */
+class obj_builder {
+public:
+    explicit obj_builder(mesh &m) : m_(m) {}
+
+    void parse_line(const char *p, const std::string &path, size_t line_no) {
+        skip_blanks(p);
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 1;
+            float x, y, z;
+            if (!parse_float(p, x) || !parse_float(p, y) || !parse_float(p, z))
+                fail(path, line_no, "bad vertex");
+            m_.px.push_back(x);
+            m_.py.push_back(y);
+            m_.pz.push_back(z);
+        } else if (p[0] == 'v' && p[1] == 'n') {
+            p += 2;
+            float x, y, z;
+            if (!parse_float(p, x) || !parse_float(p, y) || !parse_float(p, z))
+                fail(path, line_no, "bad normal");
+            nx_.push_back(x);
+            ny_.push_back(y);
+            nz_.push_back(z);
+        } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p += 1;
+            uint32_t first = 0, prev = 0;
+            int corners = 0;
+            for (;;) {
+                skip_blanks(p);
+                long v, vn = 0, vt;
+                if (!parse_int(p, v))
+                    break;
+                if (*p == '/') {
+                    ++p;
+                    if (*p != '/')
+                        parse_int(p, vt);
+                    if (*p == '/') {
+                        ++p;
+                        parse_int(p, vn);
+                    }
+                }
+                while (*p && *p != ' ' && *p != '\t')
+                    ++p;
+
+                const uint32_t index = corner(resolve(v, m_.px.size(), path, line_no),
+                                              vn == 0 ? -1 : long(resolve(vn, nx_.size(), path, line_no)));
+                if (corners == 0) {
+                    first = index;
+                } else if (corners >= 2) {
+                    m_.indices.push_back(first);
+                    m_.indices.push_back(prev);
+                    m_.indices.push_back(index);
+                }
+                prev = index;
+                ++corners;
+            }
+            if (corners < 3)
+                fail(path, line_no, "face with fewer than 3 vertices");
+        }
+        // vt, o, g, s, usemtl, mtllib, comments: not needed for tracing.
+    }
+
+    void finish() {
+        const uint32_t base = uint32_t(m_.px.size());
+        for (uint32_t &i : m_.indices) {
+            if (i & split_flag)
+                i = base + (i & ~split_flag);
+        }
+        for (const auto &s : splits_) {
+            m_.px.push_back(m_.px[s.first]);
+            m_.py.push_back(m_.py[s.first]);
+            m_.pz.push_back(m_.pz[s.first]);
+        }
+        if (!vertex_normal_.empty()) {
+            vertex_normal_.resize(base, -1);
+            for (const auto &s : splits_)
+                vertex_normal_.push_back(long(s.second));
+            m_.nx.resize(m_.px.size());
+            m_.ny.resize(m_.px.size());
+            m_.nz.resize(m_.px.size());
+            for (size_t i = 0; i < vertex_normal_.size(); ++i) {
+                if (vertex_normal_[i] < 0)
+                    continue;
+                m_.nx[i] = nx_[vertex_normal_[i]];
+                m_.ny[i] = ny_[vertex_normal_[i]];
+                m_.nz[i] = nz_[vertex_normal_[i]];
+            }
+        }
+    }
+
+private:
+    static const uint32_t split_flag = 0x80000000u;
+
+    [[noreturn]] static void fail(const std::string &path, size_t line_no, const char *what) {
+        throw scene_error(path + ":" + std::to_string(line_no) + ": " + what);
+    }
+
+    // OBJ indices are 1-based, negative ones count back from the last element read.
+    static uint32_t resolve(long index, size_t count, const std::string &path, size_t line_no) {
+        const long resolved = index < 0 ? long(count) + index : index - 1;
+        if (resolved < 0 || resolved >= long(count))
+            fail(path, line_no, "index out of range");
+        return uint32_t(resolved);
+    }
+
+    uint32_t corner(uint32_t v, long vn) {
+        if (vn < 0)
+            return v;
+        if (vertex_normal_.size() <= v)
+            vertex_normal_.resize(v + 1, -1);
+        if (vertex_normal_[v] < 0)
+            vertex_normal_[v] = vn;
+        if (vertex_normal_[v] == vn)
+            return v;
+
+        const uint64_t key = (uint64_t(v) << 32) | uint64_t(vn);
+        auto it = split_index_.find(key);
+        if (it != split_index_.end())
+            return it->second;
+        const uint32_t index = split_flag | uint32_t(splits_.size());
+        splits_.push_back(std::make_pair(v, uint32_t(vn)));
+        split_index_.emplace(key, index);
+        return index;
+    }
+
+    mesh &m_;
+    std::vector<float> nx_, ny_, nz_;
+    std::vector<long> vertex_normal_;                        // normal index of each position, -1 if none
+    std::vector<std::pair<uint32_t, uint32_t>> splits_;       // (position, normal) of split vertices
+    std::unordered_map<uint64_t, uint32_t> split_index_;
+};
+
+// ---------------------------------------------------------------------------
+// Binary format: magic, then texture paths and the environment, material
+// table, spheres, planes, lights and meshes, each prefixed by a uint32 count,
+// then boxes and quadrics the same way. Host byte order (little endian).
+// Version 1 files have no textures, version 2 files no checker patterns,
+// plane bounds, boxes or quadrics. Both were written while the renderer drew
+// the checkerboard floor itself, so loading them adds it with
+// add_checkerboard_floor() to render them as they were authored.
+
+struct binary_writer {
+    FILE *f;
+    void bytes(const void *p, size_t n) {
+        if (n && fwrite(p, 1, n, f) != n)
+            throw scene_error("write failed");
+    }
+    void u32(uint32_t v) { bytes(&v, sizeof v); }
+    void f32(float v) { bytes(&v, sizeof v); }
+    void str(const std::string &s) { u32(uint32_t(s.size())); bytes(s.data(), s.size()); }
+    void vec(const vec3 &v) { f32(v.x); f32(v.y); f32(v.z); }
+    template <class T> void array(const std::vector<T> &v) { bytes(v.data(), v.size() * sizeof(T)); }
+};
+
+struct binary_reader {
+    FILE *f;
+    std::string path;
+    void bytes(void *p, size_t n) {
+        if (n && fread(p, 1, n, f) != n)
+            throw scene_error(path + ": truncated scene file");
+    }
+    uint32_t u32() { uint32_t v; bytes(&v, sizeof v); return v; }
+    float f32() { float v; bytes(&v, sizeof v); return v; }
+    std::string str() { std::string s(u32(), '\0'); bytes(&s[0], s.size()); return s; }
+    vec3 vec() { float x = f32(), y = f32(); return vec3(x, y, f32()); }
+    template <class T> void array(std::vector<T> &v, size_t n) { v.resize(n); bytes(v.data(), n * sizeof(T)); }
+};
+
+void load_scene_binary(FILE *f, const std::string &path, scene &sc) {
+    binary_reader in{f, path};
+    char magic[sizeof binary_magic];
+    in.bytes(magic, sizeof magic);
+    const bool has_textures = magic[binary_version_at] >= '2';
+    const bool has_shapes = magic[binary_version_at] >= '3';
+
+    // Indices in the file count from its own tables, which are appended to what sc already has.
+    std::vector<uint32_t> textures;
+    if (has_textures) {
+        for (uint32_t n = in.u32(); n > 0; --n) {
+            const std::string file = in.str();
+            try {
+                textures.push_back(sc.textures.load(file));
+            } catch (const texture_error &e) {
+                throw scene_error(path + ": " + e.what());
+            }
+        }
+        const uint32_t environment = in.u32();
+        const float intensity = in.f32();
+        if (environment > textures.size())
+            throw scene_error(path + ": texture index out of range");
+        if (environment > 0) {
+            sc.environment = int32_t(textures[environment - 1]);
+            sc.environment_intensity = intensity;
+        }
+    }
+    const uint32_t first_material = uint32_t(sc.materials.size());
+    const uint32_t materials = in.u32();
+    for (uint32_t n = 0; n < materials; ++n) {
+        material m;
+        m.refractive_index = in.f32();
+        m.albedo = in.vec();
+        m.albedo3 = in.f32();
+        m.diffuse_color = in.vec();
+        m.specular_exponent = in.f32();
+        if (has_textures) {
+            const uint32_t texture = in.u32();      // + 1, 0 = none
+            m.texture_scale = in.f32();
+            if (texture > textures.size())
+                throw scene_error(path + ": texture index out of range");
+            m.texture = texture > 0 ? int32_t(textures[texture - 1]) : -1;
+        }
+        if (has_shapes) {
+            m.checker_size = in.f32();
+            m.checker_color = in.vec();
+        }
+        sc.add_material(m);
+    }
+    auto mat = [&](uint32_t index) {
+        if (index >= materials)
+            throw scene_error(path + ": material index out of range");
+        return first_material + index;
+    };
+
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        vec3 center = in.vec();
+        float radius = in.f32();
+        sc.spheres.push_back(sphere(center, radius, mat(in.u32())));
+    }
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        vec3 normal = in.vec();
+        float offset = in.f32();
+        sc.planes.push_back(plane(normal, offset, mat(in.u32())));
+        if (has_shapes) {
+            sc.planes.back().extent.min = in.vec();
+            sc.planes.back().extent.max = in.vec();
+        }
+    }
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        vec3 position = in.vec();
+        sc.lights.push_back(light(position, in.f32()));
+    }
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        sc.meshes.push_back(mesh());
+        mesh &m = sc.meshes.back();
+        m.material_id = mat(in.u32());
+        const uint32_t vertices = in.u32();
+        const uint32_t indices = in.u32();
+        const uint32_t has_normals = in.u32();
+        in.array(m.px, vertices);
+        in.array(m.py, vertices);
+        in.array(m.pz, vertices);
+        if (has_normals) {
+            in.array(m.nx, vertices);
+            in.array(m.ny, vertices);
+            in.array(m.nz, vertices);
+        }
+        in.array(m.indices, indices);
+        for (uint32_t i : m.indices) {
+            if (i >= vertices)
+                throw scene_error(path + ": vertex index out of range");
+        }
+    }
+    if (!has_shapes) {
+        add_checkerboard_floor(sc);
+        return;
+    }
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        aabb extent;
+        extent.min = in.vec();
+        extent.max = in.vec();
+        sc.boxes.push_back(box(extent, mat(in.u32())));
+    }
+    for (uint32_t n = in.u32(); n > 0; --n) {
+        float q[10];
+        for (float &c : q)
+            c = in.f32();
+        aabb extent;
+        extent.min = in.vec();
+        extent.max = in.vec();
+        sc.quadrics.push_back(quadric(q, extent, mat(in.u32())));
+    }
+}
+
+std::string directory_of(const std::string &path) {
+    const size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+}
+
+void load_scene_text(std::istream &in, const std::string &path, scene &sc) {
+    std::map<std::string, uint32_t> materials, textures;
+    auto find_material = [&](const std::string &name, size_t line_no) {
+        auto it = materials.find(name);
+        if (it == materials.end())
+            throw scene_error(path + ":" + std::to_string(line_no) + ": unknown material '" + name + "'");
+        return it->second;
+    };
+
+    std::string line;
+    for (size_t line_no = 1; std::getline(in, line); ++line_no) {
+        const size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        std::istringstream ss(line);
+        std::string kind;
+        if (!(ss >> kind))
+            continue;
+
+        auto load_texture_file = [&](const std::string &file) {
+            try {
+                return sc.textures.load(file.empty() || file[0] == '/' ? file : directory_of(path) + file);
+            } catch (const texture_error &e) {
+                throw scene_error(path + ":" + std::to_string(line_no) + ": " + e.what());
+            }
+        };
+
+        bool ok = true;
+        if (kind == "material") {
+            std::string name, texture_name;
+            float ri, a0, a1, a2, a3, r, g, b, spec;
+            ok = bool(ss >> name >> ri >> a0 >> a1 >> a2 >> a3 >> r >> g >> b >> spec);
+            if (ok) {
+                material m(ri, vec3(a0, a1, a2), a3, vec3(r, g, b), spec);
+                if (ss >> texture_name && texture_name == "checker") {
+                    ok = bool(ss >> m.checker_color.x >> m.checker_color.y >> m.checker_color.z >> m.checker_size) && m.checker_size > 0;
+                    if (!(ss >> texture_name))
+                        texture_name.clear();
+                }
+                if (ok && !texture_name.empty()) {
+                    auto it = textures.find(texture_name);
+                    if (it == textures.end())
+                        throw scene_error(path + ":" + std::to_string(line_no) + ": unknown texture '" + texture_name + "'");
+                    m.texture = int32_t(it->second);
+                    if (ss >> m.texture_scale)
+                        ok = m.texture_scale > 0;
+                }
+                materials[name] = sc.add_material(m);
+            }
+        } else if (kind == "texture") {
+            std::string name, file;
+            ok = bool(ss >> name >> file);
+            if (ok)
+                textures[name] = load_texture_file(file);
+        } else if (kind == "environment") {
+            std::string file;
+            ok = bool(ss >> file);
+            if (ok) {
+                sc.environment = int32_t(load_texture_file(file));
+                if (!(ss >> sc.environment_intensity))
+                    sc.environment_intensity = 1;
+            }
+        } else if (kind == "sphere") {
+            float x, y, z, radius;
+            std::string name;
+            ok = bool(ss >> x >> y >> z >> radius >> name);
+            if (ok)
+                sc.spheres.push_back(sphere(vec3(x, y, z), radius, find_material(name, line_no)));
+        } else if (kind == "plane") {
+            float x, y, z, offset;
+            std::string name;
+            ok = bool(ss >> x >> y >> z >> offset >> name) && vec3(x, y, z).norm() > 0;
+            if (ok) {
+                const vec3 n(x, y, z);
+                const float len = n.norm();
+                sc.planes.push_back(plane(n * (1.f / len), offset / len, find_material(name, line_no)));
+                vec3 lo, hi;
+                if (ss >> lo.x >> lo.y >> lo.z >> hi.x >> hi.y >> hi.z) {
+                    sc.planes.back().extent.expand(lo);
+                    sc.planes.back().extent.expand(hi);
+                }
+            }
+        } else if (kind == "box") {
+            vec3 lo, hi;
+            std::string name;
+            ok = bool(ss >> lo.x >> lo.y >> lo.z >> hi.x >> hi.y >> hi.z >> name);
+            if (ok) {
+                aabb extent;
+                extent.expand(lo);
+                extent.expand(hi);
+                sc.boxes.push_back(box(extent, find_material(name, line_no)));
+            }
+        } else if (kind == "quadric") {
+            float q[10];
+            vec3 lo, hi;
+            std::string name;
+            for (float &c : q)
+                ok = ok && bool(ss >> c);
+            ok = ok && bool(ss >> lo.x >> lo.y >> lo.z >> hi.x >> hi.y >> hi.z >> name);
+            if (ok) {
+                aabb extent;
+                extent.expand(lo);
+                extent.expand(hi);
+                sc.quadrics.push_back(quadric(q, extent, find_material(name, line_no)));
+            }
+        } else if (kind == "light") {
+            float x, y, z, intensity;
+            ok = bool(ss >> x >> y >> z >> intensity);
+            if (ok)
+                sc.lights.push_back(light(vec3(x, y, z), intensity));
+        } else if (kind == "mesh") {
+            std::string file, name;
+            ok = bool(ss >> file >> name);
+            if (ok) {
+                vec3 translate;
+                float scale = 1;
+                if (ss >> translate.x >> translate.y >> translate.z)
+                    ss >> scale;
+                sc.meshes.push_back(mesh());
+                mesh &m = sc.meshes.back();
+                m.material_id = find_material(name, line_no);
+                load_obj(file.empty() || file[0] == '/' ? file : directory_of(path) + file, m);
+                for (size_t i = 0; i < m.vertex_count(); ++i) {
+                    m.px[i] = m.px[i] * scale + translate.x;
+                    m.py[i] = m.py[i] * scale + translate.y;
+                    m.pz[i] = m.pz[i] * scale + translate.z;
+                }
+            }
+        } else {
+            throw scene_error(path + ":" + std::to_string(line_no) + ": unknown statement '" + kind + "'");
+        }
+        if (!ok)
+            throw scene_error(path + ":" + std::to_string(line_no) + ": malformed '" + kind + "'");
+    }
+}
+
+} // namespace
+
+void load_obj(const std::string &path, mesh &m) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw scene_error("cannot open " + path);
+
+    obj_builder builder(m);
+    const size_t chunk = 1 << 20;
+    std::vector<char> buffer(chunk + 1);
+    size_t carried = 0;      // bytes of an unfinished line kept at the front of buffer
+    size_t line_no = 1;
+    try {
+        for (;;) {
+            if (carried == buffer.size() - 1)
+                buffer.resize(buffer.size() * 2);   // a single line longer than the buffer
+            const size_t got = fread(buffer.data() + carried, 1, buffer.size() - 1 - carried, f);
+            const size_t filled = carried + got;
+            const bool eof = got == 0;
+            buffer[filled] = '\0';
+
+            char *line = buffer.data();
+            char *end = buffer.data() + filled;
+            for (;;) {
+                char *newline = static_cast<char*>(memchr(line, '\n', size_t(end - line)));
+                if (!newline) {
+                    if (eof && line < end) {
+                        builder.parse_line(line, path, line_no++);
+                        line = end;
+                    }
+                    break;
+                }
+                *newline = '\0';
+                if (newline > line && newline[-1] == '\r')
+                    newline[-1] = '\0';
+                builder.parse_line(line, path, line_no++);
+                line = newline + 1;
+            }
+            carried = size_t(end - line);
+            memmove(buffer.data(), line, carried);
+            if (eof)
+                break;
+        }
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+    fclose(f);
+    builder.finish();
+}
+
+void default_scene(scene &sc) {
+    const uint32_t      ivory = sc.add_material(material(1.0, vec3(0.6, 0.3,  0.1), 0.0, vec3(0.4, 0.4, 0.3), 50.f));
+    const uint32_t      glass = sc.add_material(material(1.5, vec3(0.0, 0.5,  0.1), 0.8, vec3(0.6, 0.7, 0.8), 50.f));
+    const uint32_t red_rubber = sc.add_material(material(1.0, vec3(0.9, 0.1,  0.0), 0.0, vec3(0.3, 0.1, 0.1), 10.f));
+    const uint32_t     mirror = sc.add_material(material(1.0, vec3(0.0, 10.0, 0.8), 0.0, vec3(1.0, 1.0, 1.0), 1425.f));
+
+    sc.spheres.push_back(sphere(vec3(  -3,    0, -16), 2, ivory));
+    sc.spheres.push_back(sphere(vec3(-1.0, -1.5, -12), 2, glass));
+    sc.spheres.push_back(sphere(vec3( 1.5, -0.5, -18), 3, red_rubber));
+    sc.spheres.push_back(sphere(vec3(   7,    5, -18), 4, mirror));
+
+    sc.lights.push_back(light(vec3(-20, 20,  20), 1.5));
+    sc.lights.push_back(light(vec3( 30, 50, -25), 1.8));
+    sc.lights.push_back(light(vec3( 30, 20,  30), 1.7));
+
+    add_checkerboard_floor(sc);
+}
+
+void add_checkerboard_floor(scene &sc) {
+    material floor;
+    floor.diffuse_color = vec3(1, 1, 1) * 0.3;
+    floor.checker_color = vec3(1, .7, .3) * 0.3;
+    floor.checker_size = 2;
+    aabb extent;
+    extent.expand(vec3(-10, -4, -30));
+    extent.expand(vec3( 10, -4, -10));
+    sc.planes.push_back(plane(vec3(0, 1, 0), -4, sc.add_material(floor), extent));
+}
+
+void load_scene(const std::string &path, scene &sc) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw scene_error("cannot open " + path);
+    char magic[sizeof binary_magic] = {};
+    const bool binary = fread(magic, 1, sizeof magic, f) == sizeof magic
+                        && memcmp(magic, binary_magic, binary_version_at) == 0 && magic[binary_version_at] >= '1'
+                        && magic[binary_version_at] <= binary_magic[binary_version_at] && magic[sizeof magic - 1] == '\0';
+    if (binary) {
+        rewind(f);
+        try {
+            load_scene_binary(f, path, sc);
+        } catch (...) {
+            fclose(f);
+            throw;
+        }
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    std::ifstream in(path);
+    load_scene_text(in, path, sc);
+}
+
+void save_scene_binary(const std::string &path, const scene &sc) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        throw scene_error("cannot write " + path);
+    binary_writer out{f};
+    try {
+        out.bytes(binary_magic, sizeof binary_magic);
+        // Texture files stay where they are; absolute paths keep the scene loadable from anywhere.
+        out.u32(uint32_t(sc.textures.size()));
+        for (uint32_t i = 0; i < sc.textures.size(); ++i) {
+            char resolved[PATH_MAX];
+            out.str(realpath(sc.textures.path(i).c_str(), resolved) ? std::string(resolved) : sc.textures.path(i));
+        }
+        out.u32(uint32_t(sc.environment + 1));
+        out.f32(sc.environment_intensity);
+        out.u32(uint32_t(sc.materials.size()));
+        for (const material &m : sc.materials) {
+            out.f32(m.refractive_index);
+            out.vec(m.albedo);
+            out.f32(m.albedo3);
+            out.vec(m.diffuse_color);
+            out.f32(m.specular_exponent);
+            out.u32(uint32_t(m.texture + 1));
+            out.f32(m.texture_scale);
+            out.f32(m.checker_size);
+            out.vec(m.checker_color);
+        }
+        out.u32(uint32_t(sc.spheres.size()));
+        for (size_t i = 0; i < sc.spheres.size(); ++i) {
+            out.vec(sc.spheres[i].center);
+            out.f32(sc.spheres[i].radius);
+            out.u32(sc.spheres[i].material_id);
+        }
+        out.u32(uint32_t(sc.planes.size()));
+        for (size_t i = 0; i < sc.planes.size(); ++i) {
+            out.vec(sc.planes[i].normal);
+            out.f32(sc.planes[i].offset);
+            out.u32(sc.planes[i].material_id);
+            out.vec(sc.planes[i].extent.min);
+            out.vec(sc.planes[i].extent.max);
+        }
+        out.u32(uint32_t(sc.lights.size()));
+        for (const light &l : sc.lights) {
+            out.vec(l.position);
+            out.f32(l.intensity);
+        }
+        out.u32(uint32_t(sc.meshes.size()));
+        for (size_t i = 0; i < sc.meshes.size(); ++i) {
+            const mesh &m = sc.meshes[i];
+            const bool has_normals = !m.nx.empty();
+            out.u32(sc.meshes[i].material_id);
+            out.u32(uint32_t(m.vertex_count()));
+            out.u32(uint32_t(m.indices.size()));
+            out.u32(has_normals);
+            out.array(m.px); out.array(m.py); out.array(m.pz);
+            if (has_normals) {
+                out.array(m.nx); out.array(m.ny); out.array(m.nz);
+            }
+            out.array(m.indices);
+        }
+        out.u32(uint32_t(sc.boxes.size()));
+        for (const box &b : sc.boxes) {
+            out.vec(b.extent.min);
+            out.vec(b.extent.max);
+            out.u32(b.material_id);
+        }
+        out.u32(uint32_t(sc.quadrics.size()));
+        for (const quadric &q : sc.quadrics) {
+            for (float c : q.q)
+                out.f32(c);
+            out.vec(q.extent.min);
+            out.vec(q.extent.max);
+            out.u32(q.material_id);
+        }
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+    if (fclose(f) != 0)
+        throw scene_error("write failed: " + path);
+}
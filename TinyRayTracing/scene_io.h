@@ -0,0 +1,55 @@
+#ifndef SCENE_IO_H
+#define SCENE_IO_H
+
+#include <stdexcept>
+#include <string>
+
+#include "scene.h"
+
+/**
+ * Scene files come in two flavours, told apart by their first bytes.
+ *
+ * Text: one statement per line, '#' starts a comment.
+ *   material <name> <refractive_index> <albedo0> <albedo1> <albedo2> <albedo3> <r> <g> <b> <specular_exponent>
+ *   sphere   <x> <y> <z> <radius> <material>
+ *   plane    <nx> <ny> <nz> <offset> <material> [<x0> <y0> <z0> <x1> <y1> <z1>]
+ *                                                        points p with n * p == offset, optionally
+ *                                                        clipped to a box (see plane::extent)
+ *   box      <x0> <y0> <z0> <x1> <y1> <z1> <material>   axis-aligned
+ *   quadric  <a> <b> <c> <d> <e> <f> <g> <h> <i> <j> <x0> <y0> <z0> <x1> <y1> <z1> <material>
+ *                                                        see struct quadric, clipped to the box
+ *   light    <x> <y> <z> <intensity>
+ *   mesh     <file.obj> <material> [<tx> <ty> <tz> [<scale>]]
+ *   texture  <name> <file.ppm|pfm>
+ *   environment <file.ppm|pfm> [<intensity>]            latitude-longitude map around the scene
+ * A material can end in checker <r> <g> <b> <size>: on planes every other
+ * square <size> units wide then has that diffuse color instead. After that
+ * it can end in <texture> [<scale>]: its diffuse color is then
+ * multiplied by the texture, mapped by latitude and longitude on spheres and
+ * repeating every <scale> units on planes. Meshes have no texture coordinates
+ * and ignore it. Relative OBJ and texture paths are resolved against the
+ * scene file's directory.
+ *
+ * Binary: the same content with meshes embedded and texture files referred to
+ * by absolute path, written by save_scene_binary().
+ * Loading it is a handful of bulk reads, which is the fast path for big meshes.
+ *
+ * Both loaders throw scene_error; the caller still has to run scene::build_accel().
+ */
+struct scene_error : std::runtime_error {
+    explicit scene_error(const std::string &what) : std::runtime_error(what) {}
+};
+
+void load_scene(const std::string &path, scene &sc);
+void save_scene_binary(const std::string &path, const scene &sc);
+
+// The built-in scene rendered when no file is given: four spheres, three lights and the checkerboard floor.
+void default_scene(scene &sc);
+
+// A checkered plane at y = -4, |x| < 10, -30 < z < -10, under the spheres of the built-in scene.
+void add_checkerboard_floor(scene &sc);
+
+// Streaming OBJ reader: positions, normals and faces (triangulated as fans).
+void load_obj(const std::string &path, mesh &m);
+
+#endif
@@ -0,0 +1,126 @@
+#include "sequence.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "scene_io.h"
+
+namespace {
+
+const int key_values[3] = { 4, 4, 6 };     // per target_kind
+
+// Interpolates the keys of t at frame into value.
+void evaluate(const sequence::track &t, int frame, float *value) {
+    const int n = key_values[t.kind];
+    const std::vector<sequence::key> &keys = t.keys;
+    auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                 [](int f, const sequence::key &k) { return f < k.frame; });
+    if (next == keys.begin() || next == keys.end()) {
+        const sequence::key &k = next == keys.begin() ? keys.front() : keys.back();
+        std::copy(k.value, k.value + n, value);
+        return;
+    }
+    const sequence::key &a = next[-1], &b = *next;
+    const float s = float(frame - a.frame) / float(b.frame - a.frame);
+    for (int i = 0; i < n; ++i)
+        value[i] = a.value[i] + (b.value[i] - a.value[i]) * s;
+}
+
+} // namespace
+
+void sequence::check(const scene &sc) const {
+    for (const track &t : tracks) {
+        if (t.kind == target_sphere && t.index >= sc.spheres.size())
+            throw scene_error("sequence animates sphere " + std::to_string(t.index) + " but the scene has "
+                              + std::to_string(sc.spheres.size()));
+        if (t.kind == target_light && t.index >= sc.lights.size())
+            throw scene_error("sequence animates light " + std::to_string(t.index) + " but the scene has "
+                              + std::to_string(sc.lights.size()));
+    }
+}
+
+void sequence::apply(int frame, scene &sc, camera &cam) const {
+    float v[6];
+    for (const track &t : tracks) {
+        evaluate(t, frame, v);
+        if (t.kind == target_sphere) {
+            sc.spheres[t.index].center = vec3(v[0], v[1], v[2]);
+            sc.spheres[t.index].radius = v[3];
+        } else if (t.kind == target_light) {
+            sc.lights[t.index].position = vec3(v[0], v[1], v[2]);
+            sc.lights[t.index].intensity = v[3];
+        } else {
+            cam.position = vec3(v[0], v[1], v[2]);
+            cam.target = vec3(v[3], v[4], v[5]);
+        }
+    }
+    if (turntable) {
+        const float angle = 6.2831853f * float(frame) / float(frames);
+        cam.position = orbit_center + vec3(orbit_radius * std::sin(angle), orbit_height, orbit_radius * std::cos(angle));
+        cam.target = orbit_center;
+    }
+}
+
+void load_sequence(const std::string &path, sequence &seq) {
+    std::ifstream in(path);
+    if (!in)
+        throw scene_error("cannot open " + path);
+
+    std::string line;
+    for (size_t line_no = 1; std::getline(in, line); ++line_no) {
+        const size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        std::istringstream ss(line);
+        std::string kind;
+        if (!(ss >> kind))
+            continue;
+
+        bool ok = true;
+        if (kind == "frames") {
+            ok = bool(ss >> seq.frames) && seq.frames > 0;
+        } else if (kind == "key") {
+            sequence::key k;
+            std::string target;
+            uint32_t index = 0;
+            ok = bool(ss >> k.frame >> target) && k.frame >= 0;
+            sequence::target_kind tk = sequence::target_camera;
+            if (ok && target == "sphere") {
+                tk = sequence::target_sphere;
+                ok = bool(ss >> index);
+            } else if (ok && target == "light") {
+                tk = sequence::target_light;
+                ok = bool(ss >> index);
+            } else if (ok && target != "camera") {
+                throw scene_error(path + ":" + std::to_string(line_no) + ": unknown key target '" + target + "'");
+            }
+            for (int i = 0; ok && i < key_values[tk]; ++i)
+                ok = bool(ss >> k.value[i]);
+            if (ok) {
+                auto t = std::find_if(seq.tracks.begin(), seq.tracks.end(), [&](const sequence::track &t) {
+                    return t.kind == tk && t.index == index;
+                });
+                if (t == seq.tracks.end()) {
+                    seq.tracks.push_back(sequence::track{tk, index, {}});
+                    t = seq.tracks.end() - 1;
+                }
+                auto at = std::lower_bound(t->keys.begin(), t->keys.end(), k.frame,
+                                           [](const sequence::key &a, int f) { return a.frame < f; });
+                if (at != t->keys.end() && at->frame == k.frame)
+                    *at = k;
+                else
+                    t->keys.insert(at, k);
+            }
+        } else if (kind == "turntable") {
+            vec3 &c = seq.orbit_center;
+            ok = bool(ss >> c.x >> c.y >> c.z >> seq.orbit_radius >> seq.orbit_height);
+            seq.turntable = ok;
+        } else {
+            throw scene_error(path + ":" + std::to_string(line_no) + ": unknown statement '" + kind + "'");
+        }
+        if (!ok)
+            throw scene_error(path + ":" + std::to_string(line_no) + ": malformed '" + kind + "'");
+    }
+}
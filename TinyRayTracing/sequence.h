@@ -0,0 +1,55 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "scene.h"
+
+/**
+ * Keyframed animation of a scene, read by load_sequence() from a text file:
+ *
+ *     frames 48
+ *     key 0  sphere 1  -1 -1.5 -12 2      # frame, sphere index, center, radius
+ *     key 47 sphere 1   2 -1.5 -14 2
+ *     key 0  light 0   -20 20 20 1.5      # frame, light index, position, intensity
+ *     key 0  camera  0 0 0  0 0 -1        # frame, position, look-at target
+ *     turntable 0 0 -16  16 2             # orbit center, radius, height
+ *
+ * Values are interpolated linearly between keys and held before the first
+ * and after the last one; whatever has no keys keeps its value from the
+ * scene. A turntable takes the camera once around the center over the
+ * sequence, looking at it, and overrides camera keys. Frames count from 0.
+ */
+struct sequence {
+    enum target_kind { target_sphere, target_light, target_camera };
+
+    struct key {
+        int   frame;
+        float value[6];
+    };
+    struct track {
+        target_kind      kind;
+        uint32_t         index;      // sphere or light, 0 for the camera
+        std::vector<key> keys;       // sorted by frame
+    };
+
+    int frames = 1;
+    std::vector<track> tracks;
+    bool  turntable = false;
+    vec3  orbit_center;
+    float orbit_radius = 0, orbit_height = 0;
+
+    // Throws scene_error when a track refers to a sphere or light sc does not have.
+    void check(const scene &sc) const;
+
+    // Poses the scene's spheres and lights and the camera for frame.
+    void apply(int frame, scene &sc, camera &cam) const;
+};
+
+// Throws scene_error.
+void load_sequence(const std::string &path, sequence &seq);
+
+#endif
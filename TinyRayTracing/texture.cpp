@@ -0,0 +1,260 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+int wrap(int i, int n) {
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// Next whitespace separated header token of a PPM or PFM file; '#' starts a comment.
+std::string header_token(FILE *f) {
+    std::string token;
+    int c = fgetc(f);
+    for (;;) {
+        while (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            c = fgetc(f);
+        if (c != '#')
+            break;
+        while (c != EOF && c != '\n')
+            c = fgetc(f);
+    }
+    while (c != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+        token += char(c);
+        c = fgetc(f);
+    }
+    return token;       // the single whitespace after the last token is consumed with it
+}
+
+void read_ppm(FILE *f, const std::string &path, int width, int height, std::vector<vec3> &rgb) {
+    const long maxval = std::atol(header_token(f).c_str());
+    if (maxval <= 0 || maxval > 65535)
+        throw texture_error(path + ": bad PPM maximum value");
+    const size_t sample_bytes = maxval > 255 ? 2 : 1;
+    std::vector<unsigned char> row(size_t(width) * 3 * sample_bytes);
+    const float scale = 1.f / float(maxval);
+    for (int y = 0; y < height; ++y) {
+        if (fread(row.data(), 1, row.size(), f) != row.size())
+            throw texture_error(path + ": truncated PPM");
+        for (int x = 0; x < width; ++x) {
+            float c[3];
+            for (int k = 0; k < 3; ++k) {
+                const unsigned char *s = &row[(size_t(x) * 3 + k) * sample_bytes];
+                c[k] = float(sample_bytes == 2 ? s[0] << 8 | s[1] : s[0]) * scale;
+            }
+            rgb[size_t(y) * width + x] = vec3(c[0], c[1], c[2]);
+        }
+    }
+}
+
+void read_pfm(FILE *f, const std::string &path, int width, int height, int channels, std::vector<vec3> &rgb) {
+    const float scale = std::strtof(header_token(f).c_str(), nullptr);
+    if (scale == 0 || !std::isfinite(scale))
+        throw texture_error(path + ": bad PFM scale");
+    const uint16_t probe = 1;
+    const bool host_little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+    const bool swap = (scale < 0) != host_little;
+    std::vector<float> row(size_t(width) * channels);
+    for (int y = height - 1; y >= 0; --y) {       // stored bottom row first
+        if (fread(row.data(), sizeof(float), row.size(), f) != row.size())
+            throw texture_error(path + ": truncated PFM");
+        if (swap) {
+            for (float &value : row) {
+                unsigned char *b = reinterpret_cast<unsigned char *>(&value);
+                std::swap(b[0], b[3]);
+                std::swap(b[1], b[2]);
+            }
+        }
+        for (int x = 0; x < width; ++x) {
+            const float *c = &row[size_t(x) * channels];
+            rgb[size_t(y) * width + x] = channels == 3 ? vec3(c[0], c[1], c[2]) : vec3(c[0], c[0], c[0]);
+        }
+    }
+}
+
+} // namespace
+
+texture::mip texture::make_mip(int width, int height) {
+    mip m;
+    m.width = width;
+    m.height = height;
+    m.tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    m.texels.resize(size_t(m.tiles_x) * tiles_y * tile_size * tile_size);
+    return m;
+}
+
+texture::texture(int width, int height, const std::vector<vec3> &rgb) {
+    levels_.push_back(make_mip(width, height));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+            levels_[0].texels[tile_offset(levels_[0], x, y)] = rgb[size_t(y) * width + x];
+    }
+    // Each level averages 2x2 texels of the one above; an odd last row or column is folded into its neighbour.
+    while (levels_.back().width > 1 || levels_.back().height > 1) {
+        const mip &src = levels_.back();
+        mip dst = make_mip(std::max(1, src.width / 2), std::max(1, src.height / 2));
+        for (int y = 0; y < dst.height; ++y) {
+            const int y0 = std::min(2 * y, src.height - 1);
+            const int y1 = y == dst.height - 1 ? src.height : std::min(2 * y + 2, src.height);
+            for (int x = 0; x < dst.width; ++x) {
+                const int x0 = std::min(2 * x, src.width - 1);
+                const int x1 = x == dst.width - 1 ? src.width : std::min(2 * x + 2, src.width);
+                vec3 sum;
+                for (int j = y0; j < y1; ++j) {
+                    for (int i = x0; i < x1; ++i)
+                        sum = sum + src.texels[tile_offset(src, i, j)];
+                }
+                dst.texels[tile_offset(dst, x, y)] = sum * (1.f / float((x1 - x0) * (y1 - y0)));
+            }
+        }
+        levels_.push_back(std::move(dst));
+    }
+}
+
+size_t texture::bytes() const {
+    size_t total = 0;
+    for (size_t l = size_t(first_); l < levels_.size(); ++l)
+        total += levels_[l].texels.size() * sizeof(vec3);
+    return total;
+}
+
+bool texture::drop_level() {
+    if (first_ + 1 >= levels())
+        return false;
+    std::vector<vec3>().swap(levels_[size_t(first_)].texels);
+    ++first_;
+    return true;
+}
+
+vec3 texture::bilinear(int level, float u, float v, bool clamp_v) const {
+    const mip &m = levels_[size_t(level)];
+    const float x = u * float(m.width) - 0.5f;
+    const float y = v * float(m.height) - 0.5f;
+    const float fx0 = std::floor(x), fy0 = std::floor(y);
+    const float fx = x - fx0, fy = y - fy0;
+    const int x0 = wrap(int(fx0), m.width), x1 = wrap(x0 + 1, m.width);
+    int y0, y1;
+    if (clamp_v) {
+        y0 = std::max(0, std::min(int(fy0), m.height - 1));
+        y1 = std::max(0, std::min(int(fy0) + 1, m.height - 1));
+    } else {
+        y0 = wrap(int(fy0), m.height);
+        y1 = wrap(y0 + 1, m.height);
+    }
+    const vec3 top    = m.texels[tile_offset(m, x0, y0)] * (1 - fx) + m.texels[tile_offset(m, x1, y0)] * fx;
+    const vec3 bottom = m.texels[tile_offset(m, x0, y1)] * (1 - fx) + m.texels[tile_offset(m, x1, y1)] * fx;
+    return top * (1 - fy) + bottom * fy;
+}
+
+vec3 texture::sample(float u, float v, float footprint, bool clamp_v) const {
+    if (!std::isfinite(u) || !std::isfinite(v))
+        u = v = 0;
+    // Repeat first, so that int conversions further down stay in range however far out (u, v) is.
+    u -= std::floor(u);
+    if (!clamp_v)
+        v -= std::floor(v);
+    else
+        v = std::max(0.f, std::min(v, 1.f));
+
+    const float texels = footprint * float(std::max(width(), height()));
+    const float lod = std::max(texels > 1 ? std::log2(texels) : 0.f, float(first_));
+    const int last = levels() - 1;
+    if (!(lod < float(last)))
+        return bilinear(last, u, v, clamp_v);
+    const int level = int(lod);
+    const float t = lod - float(level);
+    const vec3 fine = bilinear(level, u, v, clamp_v);
+    return t > 0 ? fine * (1 - t) + bilinear(level + 1, u, v, clamp_v) * t : fine;
+}
+
+void load_image(const std::string &path, int &width, int &height, std::vector<vec3> &rgb) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw texture_error("cannot open " + path);
+    try {
+        const std::string magic = header_token(f);
+        if (magic != "P6" && magic != "PF" && magic != "Pf")
+            throw texture_error(path + ": not a binary PPM or PFM file");
+        const long w = std::atol(header_token(f).c_str());
+        const long h = std::atol(header_token(f).c_str());
+        if (w <= 0 || h <= 0 || w > 65536 || h > 65536)
+            throw texture_error(path + ": bad image size");
+        width = int(w);
+        height = int(h);
+        rgb.resize(size_t(w) * size_t(h));
+        if (magic == "P6")
+            read_ppm(f, path, width, height, rgb);
+        else
+            read_pfm(f, path, width, height, magic == "PF" ? 3 : 1, rgb);
+        fclose(f);
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+}
+
+texture load_texture(const std::string &path) {
+    int width, height;
+    std::vector<vec3> rgb;
+    load_image(path, width, height, rgb);
+    return texture(width, height, rgb);
+}
+
+void texture_cache::set_budget(size_t bytes) {
+    budget_ = bytes;
+    fit_budget();
+}
+
+uint32_t texture_cache::load(const std::string &path) {
+    const std::vector<std::string>::const_iterator known = std::find(paths_.begin(), paths_.end(), path);
+    if (known != paths_.end())
+        return uint32_t(known - paths_.begin());
+    textures_.push_back(load_texture(path));
+    paths_.push_back(path);
+    fit_budget();
+    return uint32_t(textures_.size() - 1);
+}
+
+size_t texture_cache::bytes() const {
+    size_t total = 0;
+    for (const texture &t : textures_)
+        total += t.bytes();
+    return total;
+}
+
+size_t texture_cache::dropped_levels() const {
+    size_t dropped = 0;
+    for (const texture &t : textures_)
+        dropped += size_t(t.first_level());
+    return dropped;
+}
+
+void texture_cache::fit_budget() {
+    if (budget_ == 0)
+        return;
+    size_t total = bytes();
+    while (total > budget_) {
+        // The texture whose finest level is biggest gives back the most for the least blur.
+        texture *largest = nullptr;
+        size_t largest_bytes = 0;
+        for (texture &t : textures_) {
+            const int l = t.first_level();
+            const size_t level_bytes = size_t(std::max(1, t.width() >> l)) * size_t(std::max(1, t.height() >> l));
+            if (l + 1 < t.levels() && level_bytes > largest_bytes) {
+                largest = &t;
+                largest_bytes = level_bytes;
+            }
+        }
+        if (!largest)
+            break;
+        const size_t before = largest->bytes();
+        largest->drop_level();
+        total -= before - largest->bytes();
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+struct texture_error : std::runtime_error {
+    explicit texture_error(const std::string &what) : std::runtime_error(what) {}
+};
+
+/**
+ * Linear RGB image with a full mip chain, sampled trilinearly.
+ *
+ * Every level is stored in tiles of 8x8 texels, tile rows first and the
+ * texels of a tile in Morton order. The four texels of a bilinear lookup
+ * then nearly always share a tile, 768 bytes, instead of spanning two rows
+ * of a wide image, and neighbouring rays hit the same few cache lines.
+ *
+ * Texture coordinates run over [0, 1) across the image, u to the right and
+ * v downwards from the top row, and repeat outside it.
+ */
+class texture {
+public:
+    // rgb holds width * height texels, rows from the top.
+    texture(int width, int height, const std::vector<vec3> &rgb);
+
+    int width() const { return levels_[0].width; }
+    int height() const { return levels_[0].height; }
+    int levels() const { return int(levels_.size()); }
+    int first_level() const { return first_; }  // finest level still in memory
+    size_t bytes() const;                       // texels in memory
+
+    // Frees the finest level in memory, if it is not the last one. Lookups use the next one instead.
+    bool drop_level();
+
+    /**
+     * Color at (u, v), filtered over footprint: the width of the sampled
+     * area in texture coordinates. clamp_v stops v at the top and bottom
+     * rows instead of repeating, as a latitude-longitude map wants.
+     */
+    vec3 sample(float u, float v, float footprint, bool clamp_v = false) const;
+
+    // Texel (x, y) of level, which must be in memory.
+    vec3 texel(int level, int x, int y) const {
+        const mip &m = levels_[size_t(level)];
+        return m.texels[tile_offset(m, x, y)];
+    }
+
+private:
+    static const int tile_size = 8;
+
+    struct mip {
+        int width, height, tiles_x;
+        std::vector<vec3> texels;       // tiles_x * tiles_y whole tiles
+    };
+
+    static size_t tile_offset(const mip &m, int x, int y) {
+        // Bits of 0..7 spread out to the even bit positions.
+        static const uint8_t spread[8] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+        const size_t tile = size_t(y / tile_size) * size_t(m.tiles_x) + size_t(x / tile_size);
+        return tile * (tile_size * tile_size) + (spread[x % tile_size] | spread[y % tile_size] << 1);
+    }
+
+    static mip make_mip(int width, int height);
+    vec3 bilinear(int level, float u, float v, bool clamp_v) const;
+
+    std::vector<mip> levels_;
+    int first_ = 0;
+};
+
+/**
+ * Reads a binary PPM (P6, 8 or 16 bit, taken as linear) or a PFM (PF or Pf,
+ * HDR) into rgb, rows from the top. Throws texture_error.
+ */
+void load_image(const std::string &path, int &width, int &height, std::vector<vec3> &rgb);
+
+// A texture made from load_image(). Throws texture_error.
+texture load_texture(const std::string &path);
+
+/**
+ * The textures of a scene, each file loaded once. The texels of all of them
+ * are kept under budget bytes by dropping the finest mip level of the
+ * largest texture until they fit: magnified textures get blurrier instead
+ * of the process running out of memory. A texture never loses its last
+ * level, so the budget can be exceeded by a 1x1 texel per texture.
+ */
+class texture_cache {
+public:
+    // 0 = unlimited. Takes effect right away on what is loaded.
+    void set_budget(size_t bytes);
+    size_t budget() const { return budget_; }
+
+    // Index of the texture at path, loading it first if needed. Throws texture_error.
+    uint32_t load(const std::string &path);
+
+    const texture &operator[](uint32_t i) const { return textures_[i]; }
+    const std::string &path(uint32_t i) const { return paths_[i]; }
+    size_t size() const { return textures_.size(); }
+    bool empty() const { return textures_.empty(); }
+
+    size_t bytes() const;
+    size_t dropped_levels() const;      // over all textures
+
+private:
+    void fit_budget();
+
+    std::vector<texture> textures_;
+    std::vector<std::string> paths_;
+    size_t budget_ = 0;
+};
+
+// Latitude-longitude texture coordinates of unit direction d, +y up, u = 0.5 looking down -z.
+inline void latlong_coords(const vec3 &d, float &u, float &v) {
+    u = 0.5f + std::atan2(d.x, -d.z) * float(0.5 / M_PI);
+    v = std::acos(std::max(-1.f, std::min(1.f, d.y))) * float(1 / M_PI);
+}
+
+#endif
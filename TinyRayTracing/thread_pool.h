@@ -0,0 +1,146 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed-size pool with one task deque per thread.
+ * parallel_for() deals task indices round-robin into the deques; each thread
+ * drains its own deque from the back and, once empty, steals from the front
+ * of the others, so a few expensive tasks cannot leave the rest of the pool idle.
+ * The calling thread works as thread 0 while it waits.
+ */
+class thread_pool {
+public:
+    explicit thread_pool(size_t threads = 0) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < threads; ++i)
+            queues_.emplace_back(new task_queue());
+        for (size_t i = 1; i < threads; ++i)
+            workers_.emplace_back(&thread_pool::worker_main, this, i);
+    }
+
+    // Largest size worth asking for; past a few threads per hardware thread more only costs memory.
+    static size_t max_threads() {
+        return 16 * size_t(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    size_t size() const { return queues_.size(); }
+
+    /**
+     * Runs fn(task, thread) for every task in [0, count) and blocks until all
+     * of them finished. thread is in [0, size()) and identifies the executing
+     * thread, e.g. to index per-thread scratch data.
+     */
+    void parallel_for(size_t count, const std::function<void(size_t, size_t)> &fn) {
+        if (count == 0)
+            return;
+        job_ = &fn;
+        remaining_.store(count);
+        for (size_t i = 0; i < count; ++i) {
+            task_queue &q = *queues_[i % queues_.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(i);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        run_tasks(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return remaining_.load() == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool pop_own(size_t self, size_t &task) {
+        task_queue &q = *queues_[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            return false;
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, size_t &task) {
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            task_queue &q = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run_tasks(size_t self) {
+        size_t task;
+        while (pop_own(self, task) || steal(self, task)) {
+            (*job_)(task, self);
+            if (remaining_.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_all();
+            }
+        }
+    }
+
+    void worker_main(size_t self) {
+        size_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+            }
+            run_tasks(self);
+        }
+    }
+
+    std::vector<std::unique_ptr<task_queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+    std::atomic<size_t> remaining_{0};
+    const std::function<void(size_t, size_t)> *job_ = nullptr;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "tonemap.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool parse_tone_operator(const std::string &name, tone_operator &op) {
+    for (int i = 0; i < tone_operator_count; ++i) {
+        if (name == tone_operator_names[i]) {
+            op = tone_operator(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+vec3 tone_map(const vec3 &c, const tone_mapping &tone) {
+    vec3 v = tone.exposure != 0 ? c * std::exp2(tone.exposure) : c;
+    switch (tone.op) {
+    case tone_normalize: {
+        const float max = std::max(v.x, std::max(v.y, v.z));
+        if (max > 1.f) v = v * (1.f/max);
+        break;
+    }
+    case tone_clamp:
+        break;
+    case tone_reinhard: {
+        const float l = 0.2126f * v.x + 0.7152f * v.y + 0.0722f * v.z;
+        v = v * (1.f / (1.f + l));
+        break;
+    }
+    case tone_aces: {
+        float *channel[3] = { &v.x, &v.y, &v.z };
+        for (float *x : channel)
+            *x = (*x * (2.51f * *x + 0.03f)) / (*x * (2.43f * *x + 0.59f) + 0.14f);
+        break;
+    }
+    default:
+        break;
+    }
+    v = vec3(std::max(0.f, std::min(v.x, 1.f)), std::max(0.f, std::min(v.y, 1.f)), std::max(0.f, std::min(v.z, 1.f)));
+    if (tone.gamma != 1) {
+        const float inv = 1 / tone.gamma;
+        v = vec3(std::pow(v.x, inv), std::pow(v.y, inv), std::pow(v.z, inv));
+    }
+    return v;
+}
+
+void tone_map_pixels(const float *rgb, size_t count, const tone_mapping &tone, unsigned char *out) {
+    for (size_t p = 0; p < count; ++p) {
+        const vec3 c = tone_map(vec3(rgb[3*p], rgb[3*p + 1], rgb[3*p + 2]), tone);
+        out[3*p + 0] = static_cast<unsigned char>(c.x * 255);
+        out[3*p + 1] = static_cast<unsigned char>(c.y * 255);
+        out[3*p + 2] = static_cast<unsigned char>(c.z * 255);
+    }
+}
+
+void write_linear_rows(image_writer &out, const float *rgb, int width, int count, const tone_mapping &tone,
+                       std::vector<unsigned char> &scratch) {
+    if (out.takes_float()) {
+        out.write_float_rows(rgb, count);
+        return;
+    }
+    const size_t pixels = size_t(width) * count;
+    scratch.resize(pixels * 3);
+    tone_map_pixels(rgb, pixels, tone, scratch.data());
+    out.write_rows(scratch.data(), count);
+}
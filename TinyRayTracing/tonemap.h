@@ -0,0 +1,49 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "image_writer.h"
+
+/**
+ * Colors stay linear floats from the tracer to the image writer. Formats that
+ * store floats (PFM) get them as they are; 8-bit formats get them tone mapped:
+ * scaled by the exposure, compressed into [0, 1] by the operator, then gamma
+ * encoded.
+ */
+enum tone_operator {
+    tone_normalize,     // colors brighter than 1 scaled down by their largest channel, keeping the hue
+    tone_clamp,         // every channel clipped at 1
+    tone_reinhard,      // luminance L mapped to L / (1 + L)
+    tone_aces,          // filmic curve, Narkowicz's fit of the ACES reference transform
+    tone_operator_count
+};
+
+const char *const tone_operator_names[tone_operator_count] = { "normalize", "clamp", "reinhard", "aces" };
+
+struct tone_mapping {
+    tone_operator op = tone_normalize;
+    float exposure = 0;         // stops
+    float gamma    = 1;         // 1 writes linear values, 2.2 suits most displays
+};
+
+// False if name is not one of tone_operator_names.
+bool parse_tone_operator(const std::string &name, tone_operator &op);
+
+// Display color of linear color c, every channel in [0, 1].
+vec3 tone_map(const vec3 &c, const tone_mapping &tone);
+
+// count pixels of linear RGB floats to 8-bit RGB.
+void tone_map_pixels(const float *rgb, size_t count, const tone_mapping &tone, unsigned char *out);
+
+/**
+ * Hands count rows of width linear RGB pixels to out: as they are if it
+ * takes floats, else tone mapped into scratch first.
+ */
+void write_linear_rows(image_writer &out, const float *rgb, int width, int count, const tone_mapping &tone,
+                       std::vector<unsigned char> &scratch);
+
+#endif
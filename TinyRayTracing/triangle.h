@@ -0,0 +1,191 @@
+#ifndef TRIANGLE_H
+#define TRIANGLE_H
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "geometry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRT_HAVE_SSE_TRIANGLES 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Triangles of all meshes in structure-of-arrays form, stored in BVH leaf
+ * order. v[i][a][k] is coordinate a of vertex i of triangle k; mesh[k] and
+ * tri[k] lead back to the source mesh for shading. The vertex arrays carry
+ * `pad` zeroed entries at the end so four triangles can always be loaded.
+ */
+struct triangle_soa {
+    static const int pad = 3;
+    std::vector<float> v[3][3];
+    std::vector<uint32_t> mesh, tri;
+
+    size_t size() const { return mesh.size(); }
+
+    void push_back(const vec3 &a, const vec3 &b, const vec3 &c, uint32_t mesh_index, uint32_t tri_index) {
+        const vec3 *p[3] = { &a, &b, &c };
+        for (int i = 0; i < 3; ++i)
+            for (int axis = 0; axis < 3; ++axis)
+                v[i][axis].push_back((*p[i])[axis]);
+        mesh.push_back(mesh_index);
+        tri.push_back(tri_index);
+    }
+
+    // Adds the padding, call once after the last push_back().
+    void finish() {
+        for (int i = 0; i < 3; ++i)
+            for (int axis = 0; axis < 3; ++axis)
+                v[i][axis].resize(size() + pad, 0.f);
+    }
+};
+
+/**
+ * Per-ray setup of the watertight ray/triangle test (Woop, Benthin and Wald,
+ * 2013). The ray becomes the z axis of a sheared space chosen by its largest
+ * direction component; a shared edge then yields the same edge function from
+ * both of its triangles, so rays cannot slip through the seam.
+ */
+struct watertight_ray {
+    int   kx, ky, kz;       // permuted axes, kz is the dominant direction component
+    float sx, sy, sz;       // shear constants
+    float ox, oy, oz;       // origin along kx, ky, kz
+
+    watertight_ray() {}
+    watertight_ray(const vec3 &orig, const vec3 &dir) {
+        const float ax = std::fabs(dir.x), ay = std::fabs(dir.y), az = std::fabs(dir.z);
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (dir[kz] < 0)
+            std::swap(kx, ky);    // keep the winding of the permuted space
+        sx = dir[kx] / dir[kz];
+        sy = dir[ky] / dir[kz];
+        sz = 1.f / dir[kz];
+        ox = orig[kx];
+        oy = orig[ky];
+        oz = orig[kz];
+    }
+};
+
+/**
+ * Tests triangle k of tris. On a hit closer than tmax returns the distance and
+ * the barycentric weights u, v of the second and third vertex. Both sides of a
+ * triangle are hit. The SIMD kernels repeat these operations in this order so
+ * they agree with it bit for bit.
+ */
+inline bool intersect_triangle(const triangle_soa &tris, uint32_t k, const watertight_ray &r, float tmax, float &t, float &u, float &v) {
+    const float az = tris.v[0][r.kz][k] - r.oz;
+    const float bz = tris.v[1][r.kz][k] - r.oz;
+    const float cz = tris.v[2][r.kz][k] - r.oz;
+    const float ax = (tris.v[0][r.kx][k] - r.ox) - r.sx * az;
+    const float ay = (tris.v[0][r.ky][k] - r.oy) - r.sy * az;
+    const float bx = (tris.v[1][r.kx][k] - r.ox) - r.sx * bz;
+    const float by = (tris.v[1][r.ky][k] - r.oy) - r.sy * bz;
+    const float cx = (tris.v[2][r.kx][k] - r.ox) - r.sx * cz;
+    const float cy = (tris.v[2][r.ky][k] - r.oy) - r.sy * cz;
+
+    // Edge functions; the ray misses when they disagree in sign. Zeros count
+    // as inside, so a ray through an edge or vertex hits at least one triangle.
+    const float U = cx * by - cy * bx;
+    const float V = ax * cy - ay * cx;
+    const float W = bx * ay - by * ax;
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return false;
+    const float det = U + V + W;
+    if (det == 0)
+        return false;
+
+    const float T = U * (r.sz * az) + V * (r.sz * bz) + W * (r.sz * cz);
+    const float rcp_det = 1.f / det;
+    const float dist = T * rcp_det;
+    if (!(dist > 0 && dist < tmax))
+        return false;
+    t = dist;
+    u = V * rcp_det;
+    v = W * rcp_det;
+    return true;
+}
+
+/**
+ * One ray against the `count` consecutive triangles starting at `first`, four
+ * at a time with SSE. Keeps the closest hit below tmax (lowering tmax) or, with
+ * any_hit, returns at the first one. Ties go to the lower index, as in a loop
+ * over intersect_triangle().
+ */
+template <bool any_hit>
+inline bool intersect_triangles(const triangle_soa &tris, uint32_t first, uint32_t count, const watertight_ray &r,
+                                float &tmax, uint32_t &hit, float &u, float &v) {
+    bool found = false;
+#ifdef TRT_HAVE_SSE_TRIANGLES
+    const __m128 ox = _mm_set1_ps(r.ox), oy = _mm_set1_ps(r.oy), oz = _mm_set1_ps(r.oz);
+    const __m128 sx = _mm_set1_ps(r.sx), sy = _mm_set1_ps(r.sy), sz = _mm_set1_ps(r.sz);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const std::vector<float> (&p)[3][3] = tris.v;
+
+    for (uint32_t k = first; k < first + count; k += 4) {
+        const __m128 az = _mm_sub_ps(_mm_loadu_ps(&p[0][r.kz][k]), oz);
+        const __m128 bz = _mm_sub_ps(_mm_loadu_ps(&p[1][r.kz][k]), oz);
+        const __m128 cz = _mm_sub_ps(_mm_loadu_ps(&p[2][r.kz][k]), oz);
+        const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[0][r.kx][k]), ox), _mm_mul_ps(sx, az));
+        const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[0][r.ky][k]), oy), _mm_mul_ps(sy, az));
+        const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[1][r.kx][k]), ox), _mm_mul_ps(sx, bz));
+        const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[1][r.ky][k]), oy), _mm_mul_ps(sy, bz));
+        const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[2][r.kx][k]), ox), _mm_mul_ps(sx, cz));
+        const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&p[2][r.ky][k]), oy), _mm_mul_ps(sy, cz));
+
+        const __m128 U = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+        const __m128 V = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+        const __m128 W = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+        const __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+        const __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+        const __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+
+        const __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(sz, az)), _mm_mul_ps(V, _mm_mul_ps(sz, bz))),
+                                    _mm_mul_ps(W, _mm_mul_ps(sz, cz)));
+        const __m128 rcp_det = _mm_div_ps(one, det);
+        const __m128 dist = _mm_mul_ps(T, rcp_det);
+
+        __m128 ok = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+        ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpgt_ps(dist, zero), _mm_cmplt_ps(dist, _mm_set1_ps(tmax))));
+        int mask = _mm_movemask_ps(ok);
+        if (first + count - k < 4)
+            mask &= (1 << (first + count - k)) - 1;     // lanes past the run read other triangles or padding
+        if (mask == 0)
+            continue;
+
+        float d[4];
+        _mm_storeu_ps(d, dist);
+        int best = -1;
+        for (int l = 0; l < 4; ++l) {
+            if ((mask >> l & 1) && (best < 0 || d[l] < d[best]))
+                best = l;
+        }
+        float bu[4], bv[4];
+        _mm_storeu_ps(bu, _mm_mul_ps(V, rcp_det));
+        _mm_storeu_ps(bv, _mm_mul_ps(W, rcp_det));
+        tmax = d[best];
+        hit = k + uint32_t(best);
+        u = bu[best];
+        v = bv[best];
+        found = true;
+        if (any_hit)
+            return true;
+    }
+#else
+    for (uint32_t k = first; k < first + count; ++k) {
+        if (intersect_triangle(tris, k, r, tmax, tmax, u, v)) {
+            hit = k;
+            found = true;
+            if (any_hit)
+                return true;
+        }
+    }
+#endif
+    return found;
+}
+
+#endif